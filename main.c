@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,10 +9,25 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#ifdef __GNUC__
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#endif
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image/stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
+#define STBIW_ZLIB_COMPRESS zlibCompress
+#define STBIW_CRC32 pngCrc32
+unsigned char* zlibCompress(unsigned char *data, int data_len, int *out_len, int quality);
+unsigned int pngCrc32(unsigned char *buffer, int len);
 #include "stb_image/stb_image_write.h"
 
 static uint8_t* og_img;
@@ -30,25 +46,32 @@ struct arguments {
     int animate_iters;
     int wrap;
     int size;
+    int threads;
+    int dither;
+    char *intermediate;
+    int png_tier;
+    int intermediate_tier;
+    int jpeg_scale;
+    int jpeg_quality;
+    int yuv_w, yuv_h;
+    int read_ahead;
 };
 
 typedef struct arguments Arguments;
 
-void loadImg(const char* path, int* w, int* h, int* c) {
-    og_img = stbi_load(path, w, h, c, 0);
-    if (!og_img) {
-        fprintf(stderr, "Failed to load image\n");
-        exit(1);
+bool endsWith(const char* str, const char* suffix) {
+    if (!str || !suffix) {
+        return 0;
     }
-}
-
-void saveImg(const char* path, int w, int h, int c, const uint8_t* img) {
-    if (!stbi_write_png(path, w, h, c, img, w * c)) {
-        fprintf(stderr, "Failed to save image\n");
-        exit(1);
+    size_t str_len = strlen(str);
+    size_t suffix_len = strlen(suffix);
+    if (suffix_len > str_len) {
+        return 0;
     }
+    return 0 == strncmp(str + str_len - suffix_len, suffix, suffix_len);
 }
 
+
 bool isOutOfBounds(int x, int y) {
     return x < 0 || x >= img_w || y < 0 || y >= img_h;
 }
@@ -107,122 +130,3657 @@ void swapPxl(uint8_t* img, int x1, int y1, int x2, int y2) {
 }
 
 
-void pxlBleed(uint8_t* img, int randOffset, int randChance, int tolerance, int xy_mode, int wrap, int size) {
-    int dist, brightness, new_x, new_y;
-    uint8_t* orig_img = malloc(img_w * img_h * img_c);
-    memcpy(orig_img, img, img_w * img_h * img_c);
-    for (int y = 0; y < img_h; y += size) {
-        for (int x = 0; x < img_w; x += size) {
-            brightness = getPxlBrightness(img, x, y);
-            if (brightness < tolerance || rand() % 100 < randChance) {
-                dist = rand() % randOffset;
-                new_x = x + dist;
-                new_y = y + dist;
-                if (wrap) {
-                    new_x = new_x % img_w;
-                    new_y = new_y % img_h;
-                } 
-                for (int i = 0; i < size; i++) {
-                    for (int j = 0; j < size; j++) {
-                        if (xy_mode == 0) {
-                            copyPxl(img, x + i, y + j, new_x + i, y + j);
-                        } else if (xy_mode == 1) {
-                            copyPxl(img, x + i, y + j, x + i, new_y + j);
-                        } else {
-                            copyPxl(img, x + i, y + j, new_x + i, new_y + j);
-                        }
-                    }
-                }
+void pxlBleed(uint8_t* img, int randOffset, int randChance, int tolerance, int xy_mode, int wrap, int size) {
+    int dist, brightness, new_x, new_y;
+    uint8_t* orig_img = malloc(img_w * img_h * img_c);
+    memcpy(orig_img, img, img_w * img_h * img_c);
+    for (int y = 0; y < img_h; y += size) {
+        for (int x = 0; x < img_w; x += size) {
+            brightness = getPxlBrightness(img, x, y);
+            if (brightness < tolerance || rand() % 100 < randChance) {
+                dist = rand() % randOffset;
+                new_x = x + dist;
+                new_y = y + dist;
+                if (wrap) {
+                    new_x = new_x % img_w;
+                    new_y = new_y % img_h;
+                } 
+                for (int i = 0; i < size; i++) {
+                    for (int j = 0; j < size; j++) {
+                        if (xy_mode == 0) {
+                            copyPxl(img, x + i, y + j, new_x + i, y + j);
+                        } else if (xy_mode == 1) {
+                            copyPxl(img, x + i, y + j, x + i, new_y + j);
+                        } else {
+                            copyPxl(img, x + i, y + j, new_x + i, new_y + j);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    free(orig_img);
+}
+
+void pxlDiffuse(uint8_t* img, int randOffset, int randChance, int tolerance, int xy_mode, int wrap, int size) {
+    int dist, brightness, new_x, new_y;
+    uint8_t* orig_img = malloc(img_w * img_h * img_c);
+    memcpy(orig_img, img, img_w * img_h * img_c);
+    for (int y = 0; y < img_h; y += size) {
+        for (int x = 0; x < img_w; x += size) {
+            brightness = getPxlBrightness(img, x, y);
+            if (brightness < tolerance || rand() % 100 < randChance) {
+                dist = rand() % randOffset;
+                new_x = x + dist;
+                new_y = y + dist;
+                if (wrap) {
+                    new_x = new_x % img_w;
+                    new_y = new_y % img_h;
+                } 
+                for (int i = 0; i < size; i++) {
+                    for (int j = 0; j < size; j++) {
+                        if (xy_mode == 0) {
+                            swapPxl(img, x + i, y + j, new_x + i, y + j);
+                        } else if (xy_mode == 1) {
+                            swapPxl(img, x + i, y + j, x + i, new_y + j);
+                        } else {
+                            swapPxl(img, x + i, y + j, new_x + i, new_y + j);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    free(orig_img);
+}
+
+
+// Format of "-" (stdout) output, set with --format
+static const char *stdout_format = "y4m";
+
+// Whether an output path is in format fmt, by its extension or by --format for "-"
+bool isFormat(const char* path, const char* fmt) {
+    if (strcmp(path, "-") == 0) {
+        return strcmp(stdout_format, fmt) == 0;
+    }
+    size_t len = strlen(path), fmt_len = strlen(fmt);
+    return len > fmt_len && path[len - fmt_len - 1] == '.' && strcmp(path + len - fmt_len, fmt) == 0;
+}
+
+bool isAnimation(const char* path) {
+    return isFormat(path, "gif") || isFormat(path, "apng") || isFormat(path, "avi") || isFormat(path, "y4m") || isFormat(path, "mp4");
+}
+
+// The real stdout, set aside in main before anything was printed to it
+static FILE *stdout_out;
+
+FILE* openOutput(const char* path) {
+    if (strcmp(path, "-") == 0) {
+        return stdout_out;
+    }
+    return fopen(path, "wb");
+}
+
+// stb write callbacks go through this to count what they wrote
+typedef struct {
+    FILE *f;
+    size_t len;
+} FileSink;
+
+void fileWrite(void *context, void *data, int size) {
+    FileSink *sink = context;
+    sink->len += fwrite(data, 1, size, sink->f);
+}
+
+// stb reads pipes through these, skipping by reading since a pipe can't seek
+int streamRead(void *user, char *data, int size) {
+    return fread(data, 1, size, user);
+}
+
+void streamSkip(void *user, int n) {
+    while (n-- > 0 && getc(user) != EOF) {
+    }
+}
+
+int streamEof(void *user) {
+    return feof((FILE*)user) || ferror((FILE*)user);
+}
+
+static const stbi_io_callbacks stream_io = { streamRead, streamSkip, streamEof };
+
+// The first byte waiting on stdin, left there for whoever reads it next
+int stdinPeek() {
+    return ungetc(getc(stdin), stdin);
+}
+
+
+bool isint(char* str) {
+    for (int i = 0; i < strlen(str); i++) {
+        if (str[i] < '0' || str[i] > '9') {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void cleanDir(const char* path) {
+    struct dirent *de;
+    DIR *dr = opendir(path);
+    if (dr == NULL) {
+        mkdir(path, 0777);
+        return;
+    }
+    else {
+        while ((de = readdir(dr)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+                continue;
+            }
+            char file[50];
+            strcpy(file, path);
+            strcat(file, "/");
+            strcat(file, de->d_name);
+            remove(file);
+        }
+        closedir(dr);
+    }
+}
+
+
+// Worker pool shared by everything that runs off the main effect loop.
+// Waiters help drain the queue so tasks may themselves wait on subtasks.
+typedef void (*TaskFn)(void *arg);
+
+typedef struct {
+    TaskFn fn;
+    void *arg;
+} Task;
+
+typedef struct {
+    pthread_t *threads;
+    int n_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t has_work;
+    pthread_cond_t task_done;
+    Task *queue;
+    int head, count, cap;
+    bool stop;
+} Pool;
+
+static Pool pool;
+
+bool poolPop(Task *task) {
+    if (pool.count == 0) {
+        return false;
+    }
+    *task = pool.queue[pool.head];
+    pool.head = (pool.head + 1) % pool.cap;
+    pool.count--;
+    return true;
+}
+
+// Takes the first queued task whose arg lies in [first, end), wherever it is
+bool poolTake(Task *task, void *first, void *end) {
+    for (int i = 0; i < pool.count; i++) {
+        Task *t = &pool.queue[(pool.head + i) % pool.cap];
+        if ((char *)t->arg < (char *)first || (char *)t->arg >= (char *)end) {
+            continue;
+        }
+        *task = *t;
+        for (int j = i; j < pool.count - 1; j++) {
+            pool.queue[(pool.head + j) % pool.cap] = pool.queue[(pool.head + j + 1) % pool.cap];
+        }
+        pool.count--;
+        return true;
+    }
+    return false;
+}
+
+void* poolWorker(void *unused) {
+    Task task;
+    pthread_mutex_lock(&pool.lock);
+    while (!pool.stop) {
+        if (!poolPop(&task)) {
+            pthread_cond_wait(&pool.has_work, &pool.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pool.lock);
+        task.fn(task.arg);
+        pthread_mutex_lock(&pool.lock);
+        pthread_cond_broadcast(&pool.task_done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+void poolStart(int n_threads) {
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.has_work, NULL);
+    pthread_cond_init(&pool.task_done, NULL);
+    pool.cap = 64;
+    pool.queue = malloc(pool.cap * sizeof(Task));
+    pool.n_threads = n_threads;
+    pool.threads = malloc(n_threads * sizeof(pthread_t));
+    for (int i = 0; i < n_threads; i++) {
+        pthread_create(&pool.threads[i], NULL, poolWorker, NULL);
+    }
+}
+
+void poolStop() {
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = true;
+    pthread_cond_broadcast(&pool.has_work);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < pool.n_threads; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    free(pool.threads);
+    free(pool.queue);
+}
+
+void poolSubmit(TaskFn fn, void *arg) {
+    pthread_mutex_lock(&pool.lock);
+    if (pool.count == pool.cap) {
+        Task *queue = malloc(pool.cap * 2 * sizeof(Task));
+        for (int i = 0; i < pool.count; i++) {
+            queue[i] = pool.queue[(pool.head + i) % pool.cap];
+        }
+        free(pool.queue);
+        pool.queue = queue;
+        pool.head = 0;
+        pool.cap *= 2;
+    }
+    pool.queue[(pool.head + pool.count) % pool.cap] = (Task){ fn, arg };
+    pool.count++;
+    pthread_cond_signal(&pool.has_work);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Blocks until *remaining drops to zero, running queued tasks meanwhile
+void poolWait(int *remaining) {
+    Task task;
+    pthread_mutex_lock(&pool.lock);
+    while (*remaining > 0) {
+        if (poolPop(&task)) {
+            pthread_mutex_unlock(&pool.lock);
+            task.fn(task.arg);
+            pthread_mutex_lock(&pool.lock);
+            pthread_cond_broadcast(&pool.task_done);
+        }
+        else {
+            pthread_cond_wait(&pool.task_done, &pool.lock);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void poolFinish(int *remaining) {
+    pthread_mutex_lock(&pool.lock);
+    (*remaining)--;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+bool poolDone(int *remaining) {
+    pthread_mutex_lock(&pool.lock);
+    bool done = *remaining <= 0;
+    pthread_mutex_unlock(&pool.lock);
+    return done;
+}
+
+typedef void (*RangeFn)(void *ctx, int start, int end);
+
+typedef struct {
+    RangeFn fn;
+    void *ctx;
+    int start, end;
+    int *remaining;
+} RangeTask;
+
+void runRange(void *arg) {
+    RangeTask *rt = arg;
+    rt->fn(rt->ctx, rt->start, rt->end);
+    poolFinish(rt->remaining);
+}
+
+// Splits [0, n) into one chunk per worker and waits for all of them. The caller
+// only picks up chunks of its own while it waits, so a thread outside the pool
+// (the still reader) isn't held up running somebody else's encode.
+void parallelFor(int n, RangeFn fn, void *ctx) {
+    int chunks = pool.n_threads + 1;
+    if (chunks > n) {
+        chunks = n;
+    }
+    if (chunks <= 1) {
+        if (n > 0) {
+            fn(ctx, 0, n);
+        }
+        return;
+    }
+    RangeTask tasks[chunks];
+    int remaining = chunks;
+    for (int i = 0; i < chunks; i++) {
+        tasks[i] = (RangeTask){ fn, ctx, (int)((int64_t)n * i / chunks), (int)((int64_t)n * (i + 1) / chunks), &remaining };
+        poolSubmit(runRange, &tasks[i]);
+    }
+    Task task;
+    pthread_mutex_lock(&pool.lock);
+    while (remaining > 0) {
+        if (poolTake(&task, tasks, tasks + chunks)) {
+            pthread_mutex_unlock(&pool.lock);
+            task.fn(task.arg);
+            pthread_mutex_lock(&pool.lock);
+        }
+        else {
+            pthread_cond_wait(&pool.task_done, &pool.lock);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+
+// Encoder timing, summed over every thread that encoded something
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static double encode_time, encode_first, encode_last;
+static uint64_t encode_in, encode_out;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Encoders run side by side, so besides their summed time the span from the first
+// start to the last finish is kept for a wall clock rate
+void addEncodeStats(double start, size_t in, size_t out) {
+    double end = now();
+    pthread_mutex_lock(&stats_lock);
+    if (encode_time == 0 || start < encode_first) {
+        encode_first = start;
+    }
+    if (end > encode_last) {
+        encode_last = end;
+    }
+    encode_time += end - start;
+    encode_in += in;
+    encode_out += out;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+
+// Streams frames out of a gif one at a time using stb's internal gif state,
+// so only the current canvas and the two frames needed for disposal are kept
+typedef struct {
+    FILE *f;
+    stbi__context ctx;
+    stbi__gif *g;
+    uint8_t *prev;
+    uint8_t *two_back;
+    int frame;
+} GifReader;
+
+bool gifOpen(GifReader *r, const char* path) {
+    memset(r, 0, sizeof(*r));
+    r->f = strcmp(path, "-") == 0 ? stdin : stbi__fopen(path, "rb");
+    if (!r->f) {
+        return false;
+    }
+    if (r->f == stdin) {
+        stbi__start_callbacks(&r->ctx, (stbi_io_callbacks*)&stream_io, r->f);
+    }
+    else {
+        stbi__start_file(&r->ctx, r->f);
+    }
+    if (!stbi__gif_test(&r->ctx)) {
+        if (r->f != stdin) {
+            fclose(r->f);
+        }
+        return false;
+    }
+    r->g = calloc(1, sizeof(stbi__gif));
+    return true;
+}
+
+// Returns the next composited RGBA frame, or NULL at the trailer. Exits on a decode error.
+// The buffer belongs to the reader and is only valid until the next call.
+uint8_t* gifNextFrame(GifReader *r, int *delay_ms) {
+    int comp;
+    stbi__gif *g = r->g;
+    size_t stride = (size_t)g->w * g->h * 4;
+
+    if (r->frame > 0) {
+        // keep the frame before this one around for "restore to previous" disposal
+        uint8_t *tmp = r->two_back;
+        r->two_back = r->prev;
+        r->prev = tmp ? tmp : malloc(stride);
+        memcpy(r->prev, g->out, stride);
+    }
+
+    uint8_t *u = stbi__gif_load_next(&r->ctx, g, &comp, 4, r->frame > 1 ? r->two_back : NULL);
+    if (u == (uint8_t*)&r->ctx) {
+        return NULL;
+    }
+    // only the trailer ends a gif, anything else is a broken or cut off file
+    if (u == NULL) {
+        fprintf(stderr, "Failed to decode gif frame %d: %s\n", r->frame + 1, stbi_failure_reason());
+        exit(1);
+    }
+
+    r->frame++;
+    if (delay_ms) {
+        *delay_ms = g->delay;
+    }
+    return u;
+}
+
+void gifClose(GifReader *r) {
+    if (r->g) {
+        STBI_FREE(r->g->out);
+        STBI_FREE(r->g->history);
+        STBI_FREE(r->g->background);
+        free(r->g);
+    }
+    free(r->prev);
+    free(r->two_back);
+    if (r->f && r->f != stdin) {
+        fclose(r->f);
+    }
+}
+
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} ByteBuf;
+
+void bufPut(ByteBuf *b, const void *data, size_t len) {
+    if (b->len + len > b->cap) {
+        b->cap = (b->len + len) * 2;
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+// Accumulates variable width LZW codes LSB first and packs them into
+// the 255 byte sub-blocks gif image data is made of
+typedef struct {
+    ByteBuf *out;
+    uint32_t bits;
+    int nbits;
+    uint8_t block[256];
+    int block_len;
+} GifBitWriter;
+
+void gifFlushBlock(GifBitWriter *bw) {
+    if (bw->block_len == 0) {
+        return;
+    }
+    uint8_t len = bw->block_len;
+    bufPut(bw->out, &len, 1);
+    bufPut(bw->out, bw->block, bw->block_len);
+    bw->block_len = 0;
+}
+
+void gifPutCode(GifBitWriter *bw, int code, int code_size) {
+    bw->bits |= (uint32_t)code << bw->nbits;
+    bw->nbits += code_size;
+    while (bw->nbits >= 8) {
+        bw->block[bw->block_len++] = bw->bits & 0xFF;
+        bw->bits >>= 8;
+        bw->nbits -= 8;
+        if (bw->block_len == 255) {
+            gifFlushBlock(bw);
+        }
+    }
+}
+
+#define LZW_HASH_SIZE 5003
+
+// LZW compresses 8 bit palette indices into gif sub-blocks (min code size 8)
+void gifLzwEncode(ByteBuf *out, const uint8_t *indices, size_t count) {
+    const int clear_code = 256;
+    const int eoi_code = 257;
+    int32_t keys[LZW_HASH_SIZE];
+    uint16_t codes[LZW_HASH_SIZE];
+    GifBitWriter bw = { .out = out };
+
+    uint8_t min_code_size = 8;
+    bufPut(out, &min_code_size, 1);
+
+    memset(keys, -1, sizeof(keys));
+    int code_size = 9;
+    int next_code = eoi_code + 1;
+    gifPutCode(&bw, clear_code, code_size);
+
+    int cur = indices[0];
+    for (size_t i = 1; i < count; i++) {
+        int pxl = indices[i];
+        int32_t key = (cur << 8) | pxl;
+        int h = (pxl << 4 ^ cur) % LZW_HASH_SIZE;
+        int step = h == 0 ? 1 : LZW_HASH_SIZE - h;
+        while (keys[h] != -1 && keys[h] != key) {
+            h -= step;
+            if (h < 0) {
+                h += LZW_HASH_SIZE;
+            }
+        }
+        if (keys[h] == key) {
+            cur = codes[h];
+            continue;
+        }
+
+        gifPutCode(&bw, cur, code_size);
+        if (next_code < 4096) {
+            keys[h] = key;
+            codes[h] = next_code++;
+            if (next_code > (1 << code_size) && code_size < 12) {
+                code_size++;
+            }
+        } else {
+            // dictionary full, start over
+            gifPutCode(&bw, clear_code, code_size);
+            memset(keys, -1, sizeof(keys));
+            code_size = 9;
+            next_code = eoi_code + 1;
+        }
+        cur = pxl;
+    }
+    gifPutCode(&bw, cur, code_size);
+    gifPutCode(&bw, eoi_code, code_size);
+    if (bw.nbits > 0) {
+        gifPutCode(&bw, 0, 8 - bw.nbits);
+    }
+    gifFlushBlock(&bw);
+
+    uint8_t terminator = 0;
+    bufPut(out, &terminator, 1);
+}
+
+// Global palette built by median cut over a 5 bit per channel histogram
+// of sampled pixels, then mapped through a lookup table of the same size
+#define HIST_BITS 5
+#define HIST_SIZE (1 << (3 * HIST_BITS))
+#define PALETTE_FRAME_STRIDE 5
+#define PALETTE_MAX_SAMPLES (1 << 18)
+
+typedef struct {
+    uint32_t count[HIST_SIZE];
+    uint64_t sum[HIST_SIZE][3];
+    uint64_t transparent;
+} Histogram;
+
+typedef struct {
+    uint8_t colors[256][3];
+    int size;
+    int transparent;
+    uint8_t lut[HIST_SIZE];
+} Palette;
+
+typedef struct {
+    int x, y, w, h;
+} Rect;
+
+// Alpha below half is the one transparent palette entry, gray+alpha included
+static inline bool pxlTransparent(const uint8_t *pxl, int c) {
+    return (c == 4 && pxl[3] < 128) || (c == 2 && pxl[1] < 128);
+}
+
+static inline int histKey(const uint8_t *pxl, int c) {
+    int r = pxl[0], g = c >= 3 ? pxl[1] : r, b = c >= 3 ? pxl[2] : r;
+    return (r >> 3) << 10 | (g >> 3) << 5 | (b >> 3);
+}
+
+typedef struct {
+    Histogram *hist;
+    pthread_mutex_t lock;
+    const uint8_t *img;
+    int w, c;
+    int step;
+} SampleJob;
+
+void sampleRows(void *ctx, int start, int end) {
+    SampleJob *job = ctx;
+    Histogram *local = calloc(1, sizeof(Histogram));
+    for (int y = start; y < end; y++) {
+        for (int x = y % job->step; x < job->w; x += job->step) {
+            const uint8_t *pxl = job->img + ((size_t)y * job->w + x) * job->c;
+            if (pxlTransparent(pxl, job->c)) {
+                local->transparent++;
+                continue;
+            }
+            int key = histKey(pxl, job->c);
+            local->count[key]++;
+            local->sum[key][0] += pxl[0];
+            local->sum[key][1] += job->c >= 3 ? pxl[1] : pxl[0];
+            local->sum[key][2] += job->c >= 3 ? pxl[2] : pxl[0];
+        }
+    }
+    pthread_mutex_lock(&job->lock);
+    job->hist->transparent += local->transparent;
+    for (int i = 0; i < HIST_SIZE; i++) {
+        if (local->count[i]) {
+            job->hist->count[i] += local->count[i];
+            for (int k = 0; k < 3; k++) {
+                job->hist->sum[i][k] += local->sum[i][k];
+            }
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+    free(local);
+}
+
+// Adds a strided subset of one frame's pixels to the histogram
+void histAddFrame(Histogram *hist, const uint8_t *img, int w, int h, int c) {
+    SampleJob job = { hist, PTHREAD_MUTEX_INITIALIZER, img, w, c, 1 + (int)((int64_t)w * h / PALETTE_MAX_SAMPLES) };
+    parallelFor(h, sampleRows, &job);
+}
+
+typedef struct {
+    int *bins;
+    int n;
+    uint64_t weight;
+    int axis;
+    int range;
+} ColorBox;
+
+int compareBins(const void *a, const void *b, void *axis) {
+    int shift = 10 - 5 * *(const int*)axis;
+    int va = *(const int*)a >> shift & 31;
+    int vb = *(const int*)b >> shift & 31;
+    return va - vb;
+}
+
+void boxMeasure(const Histogram *hist, ColorBox *box) {
+    int lo[3] = { 31, 31, 31 }, hi[3] = { 0 };
+    box->weight = 0;
+    for (int i = 0; i < box->n; i++) {
+        int key = box->bins[i];
+        for (int k = 0; k < 3; k++) {
+            int v = key >> (10 - 5 * k) & 31;
+            lo[k] = v < lo[k] ? v : lo[k];
+            hi[k] = v > hi[k] ? v : hi[k];
+        }
+        box->weight += hist->count[key];
+    }
+    box->axis = 0;
+    for (int k = 1; k < 3; k++) {
+        if (hi[k] - lo[k] > hi[box->axis] - lo[box->axis]) {
+            box->axis = k;
+        }
+    }
+    box->range = hi[box->axis] - lo[box->axis];
+}
+
+typedef struct {
+    Palette *pal;
+} LutJob;
+
+void buildLut(void *ctx, int start, int end) {
+    Palette *pal = ((LutJob*)ctx)->pal;
+    for (int key = start; key < end; key++) {
+        int r = (key >> 10 & 31) << 3 | 4;
+        int g = (key >> 5 & 31) << 3 | 4;
+        int b = (key & 31) << 3 | 4;
+        int best = 0, best_dist = INT32_MAX;
+        for (int i = 0; i < pal->size; i++) {
+            int dr = r - pal->colors[i][0], dg = g - pal->colors[i][1], db = b - pal->colors[i][2];
+            int dist = dr * dr * 2 + dg * dg * 4 + db * db * 3;
+            if (dist < best_dist) {
+                best_dist = dist;
+                best = i;
+            }
+        }
+        pal->lut[key] = best;
+    }
+}
+
+// Median cut down to 255 colors followed by a few k-means passes over the
+// histogram bins, the last index is kept free for transparent pixels
+void paletteBuild(Palette *pal, const Histogram *hist) {
+    int *bins = malloc(HIST_SIZE * sizeof(int));
+    int n_bins = 0;
+    for (int i = 0; i < HIST_SIZE; i++) {
+        if (hist->count[i]) {
+            bins[n_bins++] = i;
+        }
+    }
+
+    ColorBox boxes[255];
+    int n_boxes = 0;
+    if (n_bins > 0) {
+        boxes[0] = (ColorBox){ bins, n_bins };
+        boxMeasure(hist, &boxes[0]);
+        n_boxes = 1;
+    }
+    while (n_boxes < 255) {
+        int split = -1;
+        uint64_t best = 0;
+        for (int i = 0; i < n_boxes; i++) {
+            uint64_t score = boxes[i].weight * boxes[i].range;
+            if (boxes[i].n > 1 && score >= best) {
+                best = score;
+                split = i;
+            }
+        }
+        if (split < 0) {
+            break;
+        }
+        ColorBox *box = &boxes[split];
+        qsort_r(box->bins, box->n, sizeof(int), compareBins, &box->axis);
+        uint64_t half = 0;
+        int mid = 0;
+        while (mid < box->n - 1 && half + hist->count[box->bins[mid]] <= box->weight / 2) {
+            half += hist->count[box->bins[mid]];
+            mid++;
+        }
+        if (mid == 0) {
+            mid = 1;
+        }
+        boxes[n_boxes] = (ColorBox){ box->bins + mid, box->n - mid };
+        box->n = mid;
+        boxMeasure(hist, box);
+        boxMeasure(hist, &boxes[n_boxes]);
+        n_boxes++;
+    }
+
+    for (int i = 0; i < n_boxes; i++) {
+        uint64_t sum[3] = { 0 };
+        for (int j = 0; j < boxes[i].n; j++) {
+            for (int k = 0; k < 3; k++) {
+                sum[k] += hist->sum[boxes[i].bins[j]][k];
+            }
+        }
+        for (int k = 0; k < 3; k++) {
+            pal->colors[i][k] = boxes[i].weight ? sum[k] / boxes[i].weight : 0;
+        }
+    }
+    pal->size = n_boxes > 0 ? n_boxes : 1;
+    if (n_boxes == 0) {
+        memset(pal->colors[0], 0, 3);
+    }
+
+    // refine the boxes' means against the actual bin colors
+    LutJob job = { pal };
+    for (int pass = 0; pass < 3; pass++) {
+        parallelFor(HIST_SIZE, buildLut, &job);
+        uint64_t sum[256][3] = { { 0 } };
+        uint64_t weight[256] = { 0 };
+        for (int i = 0; i < n_bins; i++) {
+            int idx = pal->lut[bins[i]];
+            weight[idx] += hist->count[bins[i]];
+            for (int k = 0; k < 3; k++) {
+                sum[idx][k] += hist->sum[bins[i]][k];
+            }
+        }
+        for (int i = 0; i < pal->size; i++) {
+            for (int k = 0; k < 3 && weight[i]; k++) {
+                pal->colors[i][k] = (sum[i][k] + weight[i] / 2) / weight[i];
+            }
+        }
+    }
+    parallelFor(HIST_SIZE, buildLut, &job);
+
+    for (int i = pal->size; i < 256; i++) {
+        memset(pal->colors[i], 0, 3);
+    }
+    pal->transparent = 255;
+    free(bins);
+}
+
+enum { DITHER_NONE, DITHER_BAYER, DITHER_FS };
+
+static const uint8_t bayer8[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+typedef struct {
+    const Palette *pal;
+    const uint8_t *img;
+    uint8_t *indices;
+    int w, h, c;
+    int ox, oy;
+    int dither;
+    bool has_alpha;
+    // ordered dither offsets for each of the 8 pattern rows, split into the
+    // positive and negative part so they can be applied with saturating adds
+    uint8_t *bayer_pos;
+    uint8_t *bayer_neg;
+    // error diffusion state
+    int16_t *err;
+    int *progress;
+    int next_row;
+    // a row that catches up with the one above sleeps here until it moves on
+    pthread_mutex_t lock;
+    pthread_cond_t moved;
+    int waiting;
+} MapJob;
+
+void mapRows(void *ctx, int start, int end) {
+    MapJob *job = ctx;
+    size_t row_len = (size_t)job->w * job->c;
+    uint8_t *dithered = job->dither == DITHER_BAYER ? malloc(row_len + 16) : NULL;
+    bool has_alpha = false;
+    for (int y = start; y < end; y++) {
+        const uint8_t *row = job->img + y * row_len;
+        uint8_t *out = job->indices + (size_t)y * job->w;
+        if (dithered) {
+            const uint8_t *pos = job->bayer_pos + ((job->oy + y) & 7) * row_len;
+            const uint8_t *neg = job->bayer_neg + ((job->oy + y) & 7) * row_len;
+            size_t i = 0;
+#ifdef __SSE2__
+            for (; i + 16 <= row_len; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i*)(row + i));
+                v = _mm_adds_epu8(v, _mm_loadu_si128((const __m128i*)(pos + i)));
+                v = _mm_subs_epu8(v, _mm_loadu_si128((const __m128i*)(neg + i)));
+                _mm_storeu_si128((__m128i*)(dithered + i), v);
+            }
+#endif
+            for (; i < row_len; i++) {
+                int v = row[i] + pos[i] - neg[i];
+                dithered[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+            }
+        }
+        const uint8_t *pxl = dithered ? dithered : row;
+        for (int x = 0; x < job->w; x++, pxl += job->c) {
+            if (pxlTransparent(pxl, job->c)) {
+                out[x] = job->pal->transparent;
+                has_alpha = true;
+            }
+            else {
+                out[x] = job->pal->lut[histKey(pxl, job->c)];
+            }
+        }
+    }
+    if (has_alpha) {
+        __atomic_store_n(&job->has_alpha, true, __ATOMIC_RELAXED);
+    }
+    free(dithered);
+}
+
+// Floyd-Steinberg, rows are claimed in order and each one trails the row
+// above it by two pixels so every row in flight can run on its own thread
+#define FS_CHUNK 64
+
+void diffuseWait(MapJob *job, int y, int need) {
+    if (__atomic_load_n(&job->progress[y], __ATOMIC_ACQUIRE) >= need) {
+        return;
+    }
+    pthread_mutex_lock(&job->lock);
+    __atomic_fetch_add(&job->waiting, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&job->progress[y], __ATOMIC_SEQ_CST) < need) {
+        pthread_cond_wait(&job->moved, &job->lock);
+    }
+    __atomic_fetch_sub(&job->waiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&job->lock);
+}
+
+void diffusePost(MapJob *job, int y, int x) {
+    __atomic_store_n(&job->progress[y], x, __ATOMIC_SEQ_CST);
+    // the lock is only taken when a row below has gone to sleep
+    if (__atomic_load_n(&job->waiting, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&job->lock);
+        pthread_cond_broadcast(&job->moved);
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+void diffuseRows(void *ctx, int start, int end) {
+    MapJob *job = ctx;
+    int w = job->w, c = job->c;
+    bool has_alpha = false;
+    for (;;) {
+        int y = __atomic_fetch_add(&job->next_row, 1, __ATOMIC_RELAXED);
+        if (y >= job->h) {
+            break;
+        }
+        const uint8_t *row = job->img + (size_t)y * w * c;
+        uint8_t *out = job->indices + (size_t)y * w;
+        int16_t *err = job->err + (size_t)y * (w + 2) * 3 + 3;
+        int16_t *below = err + (w + 2) * 3;
+        int carry[3] = { 0 };
+        for (int x0 = 0; x0 < w; x0 += FS_CHUNK) {
+            int x1 = x0 + FS_CHUNK < w ? x0 + FS_CHUNK : w;
+            if (y > 0) {
+                diffuseWait(job, y - 1, x1 + 1 < w ? x1 + 1 : w);
+            }
+            for (int x = x0; x < x1; x++) {
+                const uint8_t *pxl = row + x * c;
+                if (pxlTransparent(pxl, c)) {
+                    out[x] = job->pal->transparent;
+                    has_alpha = true;
+                    carry[0] = carry[1] = carry[2] = 0;
+                    continue;
+                }
+                uint8_t want[3];
+                for (int k = 0; k < 3; k++) {
+                    int v = (c >= 3 ? pxl[k] : pxl[0]) + (err[x * 3 + k] + carry[k]) / 16;
+                    want[k] = v < 0 ? 0 : v > 255 ? 255 : v;
+                }
+                uint8_t idx = job->pal->lut[histKey(want, 3)];
+                out[x] = idx;
+                for (int k = 0; k < 3; k++) {
+                    int e = want[k] - job->pal->colors[idx][k];
+                    carry[k] = e * 7;
+                    below[(x - 1) * 3 + k] += e * 3;
+                    below[x * 3 + k] += e * 5;
+                    below[(x + 1) * 3 + k] += e;
+                }
+            }
+            diffusePost(job, y, x1);
+        }
+    }
+    if (has_alpha) {
+        __atomic_store_n(&job->has_alpha, true, __ATOMIC_RELAXED);
+    }
+}
+
+// Maps a w x h frame, whose top left corner sits at (ox, oy) of the full
+// frame, onto the palette. Returns whether any pixel came out transparent.
+bool paletteMap(const Palette *pal, const uint8_t *img, int w, int h, int c, int ox, int oy, int dither, uint8_t *indices) {
+    MapJob job = { pal, img, indices, w, h, c, ox, oy, dither, false };
+    size_t row_len = (size_t)w * c;
+
+    if (dither == DITHER_FS) {
+        job.err = calloc((size_t)(w + 2) * (h + 1) * 3, sizeof(int16_t));
+        job.progress = calloc(h, sizeof(int));
+        pthread_mutex_init(&job.lock, NULL);
+        pthread_cond_init(&job.moved, NULL);
+        parallelFor(pool.n_threads + 1, diffuseRows, &job);
+        pthread_mutex_destroy(&job.lock);
+        pthread_cond_destroy(&job.moved);
+        free(job.err);
+        free(job.progress);
+        return job.has_alpha;
+    }
+
+    if (dither == DITHER_BAYER) {
+        job.bayer_pos = calloc(8, row_len);
+        job.bayer_neg = calloc(8, row_len);
+        for (int y = 0; y < 8; y++) {
+            for (int x = 0; x < w; x++) {
+                int o = bayer8[(oy + y) & 7][(ox + x) & 7] / 4 - 8;
+                for (int k = 0; k < (c >= 3 ? 3 : 1); k++) {
+                    size_t i = (((oy + y) & 7) * row_len) + x * c + k;
+                    job.bayer_pos[i] = o > 0 ? o : 0;
+                    job.bayer_neg[i] = o < 0 ? -o : 0;
+                }
+            }
+        }
+    }
+
+    parallelFor(h, mapRows, &job);
+    free(job.bayer_pos);
+    free(job.bayer_neg);
+    return job.has_alpha;
+}
+
+
+// Frame diffing, finds the bounding box of everything that changed since the previous frame
+int firstDiff(const uint8_t *a, const uint8_t *b, int len) {
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+        int mask = _mm_movemask_epi8(eq) ^ 0xFFFF;
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (a[i] != b[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int lastDiff(const uint8_t *a, const uint8_t *b, int len) {
+    int i = len;
+#ifdef __SSE2__
+    for (; i >= 16; i -= 16) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i - 16)), _mm_loadu_si128((const __m128i*)(b + i - 16)));
+        int mask = _mm_movemask_epi8(eq) ^ 0xFFFF;
+        if (mask) {
+            return i - 16 + 31 - __builtin_clz(mask);
+        }
+    }
+#endif
+    while (i-- > 0) {
+        if (a[i] != b[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+typedef struct {
+    const uint8_t *a, *b;
+    int w, c;
+    pthread_mutex_t lock;
+    int min_x, max_x, min_y, max_y;
+} DiffJob;
+
+void diffRows(void *ctx, int start, int end) {
+    DiffJob *job = ctx;
+    int row_len = job->w * job->c;
+    int min_x = job->w, max_x = -1, min_y = -1, max_y = -1;
+    for (int y = start; y < end; y++) {
+        const uint8_t *a = job->a + (size_t)y * row_len;
+        const uint8_t *b = job->b + (size_t)y * row_len;
+        int lo = firstDiff(a, b, row_len);
+        if (lo < 0) {
+            continue;
+        }
+        int hi = lastDiff(a, b, row_len);
+        if (lo / job->c < min_x) {
+            min_x = lo / job->c;
+        }
+        if (hi / job->c > max_x) {
+            max_x = hi / job->c;
+        }
+        if (min_y < 0) {
+            min_y = y;
+        }
+        max_y = y;
+    }
+    if (max_y < 0) {
+        return;
+    }
+    pthread_mutex_lock(&job->lock);
+    if (min_x < job->min_x) job->min_x = min_x;
+    if (max_x > job->max_x) job->max_x = max_x;
+    if (job->min_y < 0 || min_y < job->min_y) job->min_y = min_y;
+    if (max_y > job->max_y) job->max_y = max_y;
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Returns false when the two frames are identical
+bool frameDiff(const uint8_t *prev, const uint8_t *cur, int w, int h, int c, Rect *rect) {
+    DiffJob job = { prev, cur, w, c, PTHREAD_MUTEX_INITIALIZER, w, -1, -1, -1 };
+    parallelFor(h, diffRows, &job);
+    if (job.max_y < 0) {
+        return false;
+    }
+    *rect = (Rect){ job.min_x, job.min_y, job.max_x - job.min_x + 1, job.max_y - job.min_y + 1 };
+    return true;
+}
+
+
+// Frames are encoded on the worker pool into their own buffers and written
+// to the file strictly in the order they were submitted
+#define MAX_IN_FLIGHT 16
+
+typedef struct {
+    ByteBuf out;
+    int pending;
+} EncodeJob;
+
+typedef struct {
+    FILE *f;
+    EncodeJob *jobs[MAX_IN_FLIGHT];
+    int head, in_flight;
+} FrameQueue;
+
+// Appends finished frames to the file in order, waiting for the oldest if asked to
+void queueDrain(FrameQueue *q, bool wait) {
+    while (q->in_flight > 0) {
+        EncodeJob *job = q->jobs[q->head];
+        if (wait) {
+            poolWait(&job->pending);
+        }
+        else if (!poolDone(&job->pending)) {
+            break;
+        }
+        fwrite(job->out.data, 1, job->out.len, q->f);
+        fflush(q->f);
+        free(job->out.data);
+        free(job);
+        q->head = (q->head + 1) % MAX_IN_FLIGHT;
+        q->in_flight--;
+        wait = false;
+    }
+}
+
+// Jobs must start with an EncodeJob and be malloc'd, the queue frees them once written
+void queueSubmit(FrameQueue *q, EncodeJob *job, TaskFn encode) {
+    if (q->in_flight == MAX_IN_FLIGHT) {
+        queueDrain(q, true);
+    }
+    job->pending = 1;
+    q->jobs[(q->head + q->in_flight) % MAX_IN_FLIGHT] = job;
+    q->in_flight++;
+    poolSubmit(encode, job);
+    queueDrain(q, false);
+}
+
+void queueFlush(FrameQueue *q) {
+    while (q->in_flight > 0) {
+        queueDrain(q, true);
+    }
+}
+
+// Copies a rectangle out of a w pixel wide frame
+uint8_t* copyRect(const uint8_t *img, int w, int c, Rect rect) {
+    uint8_t *out = malloc((size_t)rect.w * rect.h * c);
+    for (int y = 0; y < rect.h; y++) {
+        memcpy(out + (size_t)y * rect.w * c, img + ((size_t)(rect.y + y) * w + rect.x) * c, (size_t)rect.w * c);
+    }
+    return out;
+}
+
+// Copies a rectangle of img over the same spot in dst
+void pasteRect(uint8_t *dst, const uint8_t *img, int w, int c, Rect rect) {
+    for (int y = rect.y; y < rect.y + rect.h; y++) {
+        size_t row = ((size_t)y * w + rect.x) * c;
+        memcpy(dst + row, img + row, (size_t)rect.w * c);
+    }
+}
+
+
+// Writes a looping gif89a one frame at a time as frames come out of the effect loop.
+// Opaque frames only store the changed rectangle, with pixels that did not change
+// left transparent so they compress away.
+typedef struct {
+    EncodeJob base;
+    const Palette *pal;
+    uint8_t *pixels;
+    uint8_t *prev;
+    Rect rect;
+    int c;
+    int dither;
+    int delay_cs;
+    int disposal;
+} GifFrameJob;
+
+typedef struct {
+    FILE *f;
+    int w, h;
+    const Palette *pal;
+    int dither;
+    uint8_t *prev;
+    int frames;
+    GifFrameJob *held;
+    bool held_alpha;
+    FrameQueue q;
+} GifWriter;
+
+void gifPut16(ByteBuf *b, int v) {
+    uint8_t le[2] = { v & 0xFF, (v >> 8) & 0xFF };
+    bufPut(b, le, 2);
+}
+
+bool gifBegin(GifWriter *gw, const char* path, int w, int h, const Palette *pal, int dither) {
+    memset(gw, 0, sizeof(*gw));
+    gw->f = openOutput(path);
+    if (!gw->f) {
+        return false;
+    }
+    gw->w = w;
+    gw->h = h;
+    gw->pal = pal;
+    gw->dither = dither;
+    gw->q.f = gw->f;
+
+    ByteBuf b = { 0 };
+    bufPut(&b, "GIF89a", 6);
+    gifPut16(&b, w);
+    gifPut16(&b, h);
+    uint8_t screen[3] = { 0xF7, 0, 0 }; // 256 entry global color table
+    bufPut(&b, screen, 3);
+    bufPut(&b, pal->colors, sizeof(pal->colors));
+
+    // loop forever
+    bufPut(&b, "\x21\xFF\x0BNETSCAPE2.0\x03\x01\x00\x00\x00", 19);
+
+    fwrite(b.data, 1, b.len, gw->f);
+    free(b.data);
+    return true;
+}
+
+void gifEncodeFrame(void *arg) {
+    GifFrameJob *job = arg;
+    const Palette *pal = job->pal;
+    Rect rect = job->rect;
+    size_t count = (size_t)rect.w * rect.h;
+    uint8_t *indices = malloc(count);
+    double start = now();
+
+    paletteMap(pal, job->pixels, rect.w, rect.h, job->c, rect.x, rect.y, job->dither, indices);
+    if (job->prev) {
+        for (size_t i = 0; i < count; i++) {
+            if (memcmp(job->pixels + i * job->c, job->prev + i * job->c, job->c) == 0) {
+                indices[i] = pal->transparent;
+            }
+        }
+    }
+
+    ByteBuf *b = &job->base.out;
+    uint8_t gce[4] = { 0x21, 0xF9, 0x04, job->disposal << 2 | 1 };
+    bufPut(b, gce, 4);
+    gifPut16(b, job->delay_cs);
+    uint8_t gce_end[2] = { pal->transparent, 0 };
+    bufPut(b, gce_end, 2);
+
+    uint8_t desc = 0x2C;
+    bufPut(b, &desc, 1);
+    gifPut16(b, rect.x);
+    gifPut16(b, rect.y);
+    gifPut16(b, rect.w);
+    gifPut16(b, rect.h);
+    uint8_t flags = 0;
+    bufPut(b, &flags, 1);
+
+    gifLzwEncode(b, indices, count);
+    addEncodeStats(start, count * job->c, b->len);
+
+    free(indices);
+    free(job->pixels);
+    free(job->prev);
+    poolFinish(&job->base.pending);
+}
+
+bool frameHasAlpha(const uint8_t *img, int w, int h, int c) {
+    if (c != 2 && c != 4) {
+        return false;
+    }
+    size_t count = (size_t)w * h;
+    for (size_t i = 0; i < count; i++) {
+        if (pxlTransparent(img + i * c, c)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void gifWriteFrame(GifWriter *gw, const uint8_t *img, int c, int delay_cs) {
+    Rect rect = { 0, 0, gw->w, gw->h };
+    // see-through pixels need a cleared canvas under them, so the frame before
+    // this one is disposed to background and this one can't be a delta. The
+    // previous frame is held back until then to pick its disposal.
+    bool alpha = frameHasAlpha(img, gw->w, gw->h, c);
+    if (gw->held) {
+        Rect full = { 0, 0, gw->w, gw->h };
+        GifFrameJob *held = gw->held;
+        if (alpha && (held->rect.w != gw->w || held->rect.h != gw->h)) {
+            // disposal only clears the frame's own rectangle, so a delta is
+            // widened to the whole canvas, which prev holds all of by now
+            free(held->pixels);
+            free(held->prev);
+            held->pixels = copyRect(gw->prev, gw->w, c, full);
+            held->prev = NULL;
+            held->rect = full;
+        }
+        held->disposal = alpha ? 2 : 1;
+        queueSubmit(&gw->q, &held->base, gifEncodeFrame);
+    }
+    bool delta = gw->frames > 0 && !alpha && !gw->held_alpha;
+    gw->held_alpha = alpha;
+
+    if (delta && !frameDiff(gw->prev, img, gw->w, gw->h, c, &rect)) {
+        // nothing changed, a single unchanged pixel still carries the delay
+        rect = (Rect){ 0, 0, 1, 1 };
+    }
+
+    GifFrameJob *job = calloc(1, sizeof(GifFrameJob));
+    job->pal = gw->pal;
+    job->pixels = copyRect(img, gw->w, c, rect);
+    job->prev = delta ? copyRect(gw->prev, gw->w, c, rect) : NULL;
+    job->rect = rect;
+    job->c = c;
+    job->dither = gw->dither;
+    job->delay_cs = delay_cs;
+
+    if (!gw->prev) {
+        gw->prev = malloc((size_t)gw->w * gw->h * c);
+    }
+    pasteRect(gw->prev, img, gw->w, c, rect);
+
+    gw->frames++;
+    gw->held = job;
+}
+
+void gifEnd(GifWriter *gw) {
+    if (gw->held) {
+        gw->held->disposal = 1;
+        queueSubmit(&gw->q, &gw->held->base, gifEncodeFrame);
+    }
+    queueFlush(&gw->q);
+    fputc(0x3B, gw->f);
+    fclose(gw->f);
+    free(gw->prev);
+    gw->f = NULL;
+}
+
+
+// Speed tiers for png output, from no compression at all to trying several
+// filter strategies with long hash chains and keeping the smallest
+enum { PNG_STORE, PNG_FAST, PNG_DEFAULT, PNG_SMALL };
+
+typedef struct {
+    const char *name;
+    int filter;      // fixed filter, -1 to pick one adaptively, -2 to try several strategies
+    int band;        // adaptive: score one row and reuse its filter for this many rows
+    int quality;     // stb deflate hash chain setting, 0 stores the data uncompressed
+} PngTier;
+
+static const PngTier png_tiers[] = {
+    { "store", 0, 0, 0 },
+    { "fast", 2, 0, 5 },
+    { "default", -1, 16, 8 },
+    { "small", -2, 0, 32 },
+};
+
+int pngTierByName(const char *name) {
+    for (int i = 0; i < (int)(sizeof(png_tiers) / sizeof(png_tiers[0])); i++) {
+        if (strcmp(name, png_tiers[i].name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Animated png, frames are filtered and deflated with stb's png code on the
+// worker pool. Each frame after the first only stores the changed rectangle,
+// which simply replaces that part of the canvas.
+void pngPut32(ByteBuf *b, uint32_t v) {
+    uint8_t be[4] = { v >> 24, v >> 16, v >> 8, v };
+    bufPut(b, be, 4);
+}
+
+void pngPut16(ByteBuf *b, int v) {
+    uint8_t be[2] = { v >> 8, v };
+    bufPut(b, be, 2);
+}
+
+// Starts a chunk, returns where its type begins so pngChunkEnd can checksum it
+size_t pngChunkBegin(ByteBuf *b, const char *type, uint32_t len) {
+    pngPut32(b, len);
+    size_t start = b->len;
+    bufPut(b, type, 4);
+    return start;
+}
+
+void pngChunkEnd(ByteBuf *b, size_t start) {
+    pngPut32(b, stbiw__crc32(b->data + start, b->len - start));
+}
+
+void pngChunk(ByteBuf *b, const char *type, const void *data, uint32_t len) {
+    size_t start = pngChunkBegin(b, type, len);
+    bufPut(b, data, len);
+    pngChunkEnd(b, start);
+}
+
+void pngHeader(ByteBuf *b, int w, int h, int c) {
+    static const int ctype[5] = { -1, 0, 4, 2, 6 };
+    bufPut(b, "\x89PNG\r\n\x1A\n", 8);
+    size_t start = pngChunkBegin(b, "IHDR", 13);
+    pngPut32(b, w);
+    pngPut32(b, h);
+    uint8_t fmt[5] = { 8, ctype[c], 0, 0, 0 };
+    bufPut(b, fmt, 5);
+    pngChunkEnd(b, start);
+}
+
+// Png chunk crc, slice-by-8 tables with a carry-less multiply path picked at runtime
+static uint32_t crc_table[8][256];
+static bool crc_clmul;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+void crcInit() {
+    for (int i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        }
+        crc_table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t c = crc_table[t - 1][i];
+            crc_table[t][i] = (c >> 8) ^ crc_table[0][c & 0xFF];
+        }
+    }
+#if defined(__SSE2__) && defined(__GNUC__)
+    crc_clmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+// Works on the inverted crc register, like the inner loop of zlib's crc32
+uint32_t crc32Slice8(uint32_t crc, const uint8_t *data, size_t len) {
+    while (len > 0 && ((uintptr_t)data & 7)) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xFF];
+        len--;
+    }
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, data, 4);
+        memcpy(&hi, data + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+              crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+              crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xFF];
+        len--;
+    }
+    return crc;
+}
+
+#if defined(__SSE2__) && defined(__GNUC__)
+// Folds four 128 bit lanes at a time with pclmulqdq, then reduces to 32 bits
+// with a Barrett step (Intel's "Fast CRC Computation Using PCLMULQDQ").
+// len must be a multiple of 16 and at least 64.
+__attribute__((target("pclmul,sse4.1")))
+uint32_t crc32Clmul(uint32_t crc, const uint8_t *data, size_t len) {
+    static const uint64_t __attribute__((aligned(16))) k1k2[2] = { 0x0154442BD4, 0x01C6E41596 };
+    static const uint64_t __attribute__((aligned(16))) k3k4[2] = { 0x01751997D0, 0x00CCAA009E };
+    static const uint64_t __attribute__((aligned(16))) k5k0[2] = { 0x0163CD6124, 0x0000000000 };
+    static const uint64_t __attribute__((aligned(16))) poly[2] = { 0x01DB710641, 0x01F7011641 };
+
+    __m128i x1 = _mm_loadu_si128((const __m128i*)data);
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(data + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(data + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(data + 48));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    __m128i k = _mm_load_si128((const __m128i*)k1k2);
+    data += 64;
+    len -= 64;
+    while (len >= 64) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)data));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 48)));
+        data += 64;
+        len -= 64;
+    }
+
+    // fold the four lanes into one, then any 16 byte blocks left
+    k = _mm_load_si128((const __m128i*)k3k4);
+    __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+    while (len >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)data)), x5);
+        data += 16;
+        len -= 16;
+    }
+
+    // 128 to 64 bits
+    __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    k = _mm_loadl_epi64((const __m128i*)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    k = _mm_load_si128((const __m128i*)poly);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+#endif
+
+// Stands in for stbiw__crc32
+unsigned int pngCrc32(unsigned char *buffer, int len) {
+    pthread_once(&crc_once, crcInit);
+    uint32_t crc = ~0u;
+    size_t n = len;
+#if defined(__SSE2__) && defined(__GNUC__)
+    if (crc_clmul && n >= 64) {
+        crc = crc32Clmul(crc, buffer, n & ~(size_t)15);
+        buffer += n & ~(size_t)15;
+        n &= 15;
+    }
+#endif
+    return ~crc32Slice8(crc, buffer, n);
+}
+
+#ifdef __SSE2__
+uint32_t hsum32(__m128i v) {
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+#endif
+
+uint32_t adler32(uint32_t adler, const uint8_t *data, size_t len) {
+    uint32_t s1 = adler & 0xFFFF, s2 = adler >> 16;
+#ifdef __SSE2__
+    // 16 bytes at a time: psadbw sums the bytes for s1, pmaddwd weights them
+    // 16..1 for s2, and each block's starting s1 is summed separately and
+    // counted 16 times
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i w_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+    const __m128i w_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+    while (len >= 16) {
+        size_t n = len < 5552 ? len & ~(size_t)15 : 5552;
+        __m128i v1 = zero, v2 = zero, vp = zero;
+        for (size_t i = 0; i < n; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+            vp = _mm_add_epi32(vp, v1);
+            v1 = _mm_add_epi32(v1, _mm_sad_epu8(v, zero));
+            v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), w_lo));
+            v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), w_hi));
+        }
+        s2 = ((uint64_t)s1 * n + (uint64_t)hsum32(vp) * 16 + hsum32(v2) + s2) % 65521;
+        s1 = (s1 + hsum32(v1)) % 65521;
+        data += n;
+        len -= n;
+    }
+#endif
+    while (len > 0) {
+        size_t n = len < 5552 ? len : 5552;
+        for (size_t i = 0; i < n; i++) {
+            s1 += data[i];
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+        data += n;
+        len -= n;
+    }
+    return s2 << 16 | s1;
+}
+
+// Adler-32 of two buffers back to back, from the checksum of each and the length of the second
+uint32_t adler32Combine(uint32_t a, uint32_t b, size_t b_len) {
+    uint32_t rem = b_len % 65521;
+    uint32_t s1 = a & 0xFFFF;
+    uint32_t s2 = (uint64_t)rem * s1 % 65521;
+    s1 += (b & 0xFFFF) + 65521 - 1;
+    s2 += (a >> 16) + (b >> 16) + 65521 - rem;
+    if (s1 >= 65521) s1 -= 65521;
+    if (s1 >= 65521) s1 -= 65521;
+    if (s2 >= 65521 * 2) s2 -= 65521 * 2;
+    if (s2 >= 65521) s2 -= 65521;
+    return s2 << 16 | s1;
+}
+
+// Zlib stream made of stored deflate blocks, for when speed is all that matters
+uint8_t* zlibStore(const uint8_t *data, int len, int *out_len) {
+    int blocks = len / 65535 + 1;
+    uint8_t *out = malloc(2 + blocks * 5 + len + 4);
+    uint8_t *o = out;
+    *o++ = 0x78;
+    *o++ = 0x01;
+    for (int i = 0; i < blocks; i++) {
+        int block = len - i * 65535 < 65535 ? len - i * 65535 : 65535;
+        *o++ = i == blocks - 1;
+        *o++ = block & 0xFF;
+        *o++ = block >> 8;
+        *o++ = ~block & 0xFF;
+        *o++ = (~block >> 8) & 0xFF;
+        memcpy(o, data + (size_t)i * 65535, block);
+        o += block;
+    }
+    uint32_t adler = adler32(1, data, len);
+    *o++ = adler >> 24;
+    *o++ = adler >> 16;
+    *o++ = adler >> 8;
+    *o++ = adler;
+    *out_len = o - out;
+    return out;
+}
+
+#define DEFLATE_CHUNK (128 * 1024)
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH 16384
+
+typedef struct {
+    ByteBuf *out;
+    uint32_t bits;
+    int nbits;
+} DeflateBits;
+
+void deflatePut(DeflateBits *d, uint32_t code, int n) {
+    d->bits |= code << d->nbits;
+    d->nbits += n;
+    while (d->nbits >= 8) {
+        if (d->out->len == d->out->cap) {
+            d->out->cap = d->out->cap * 2 + 256;
+            d->out->data = realloc(d->out->data, d->out->cap);
+        }
+        d->out->data[d->out->len++] = d->bits;
+        d->bits >>= 8;
+        d->nbits -= 8;
+    }
+}
+
+// Huffman codes are sent most significant bit first, everything else least significant first
+void deflatePutRev(DeflateBits *d, int code, int n) {
+    int rev = 0;
+    for (int i = 0; i < n; i++) {
+        rev = rev << 1 | (code >> i & 1);
+    }
+    deflatePut(d, rev, n);
+}
+
+// Symbol from the fixed literal/length huffman table
+void deflatePutSym(DeflateBits *d, int sym) {
+    if (sym <= 143) {
+        deflatePutRev(d, 0x30 + sym, 8);
+    }
+    else if (sym <= 255) {
+        deflatePutRev(d, 0x190 + sym - 144, 9);
+    }
+    else if (sym <= 279) {
+        deflatePutRev(d, sym - 256, 7);
+    }
+    else {
+        deflatePutRev(d, 0xC0 + sym - 280, 8);
+    }
+}
+
+uint32_t deflateHash(const uint8_t *p) {
+    uint32_t h = p[0] + (p[1] << 8) + (p[2] << 16);
+    h ^= h << 3;
+    h += h >> 5;
+    h ^= h << 4;
+    h += h >> 17;
+    h ^= h << 25;
+    h += h >> 6;
+    return h & (DEFLATE_HASH - 1);
+}
+
+// Hash buckets keep the 2 * quality most recent positions and drop the older
+// half when full, the same policy as stb's compressor
+typedef struct {
+    int *pos;
+    int *count;
+    int depth;
+} DeflateHash;
+
+void deflateInsert(DeflateHash *t, uint32_t h, int pos) {
+    int *bucket = t->pos + (size_t)h * t->depth * 2;
+    if (t->count[h] == t->depth * 2) {
+        memmove(bucket, bucket + t->depth, t->depth * sizeof(int));
+        t->count[h] = t->depth;
+    }
+    bucket[t->count[h]++] = pos;
+}
+
+int deflateLongest(const DeflateHash *t, const uint8_t *data, int i, int end, int min_pos, int *best_pos) {
+    uint32_t h = deflateHash(data + i);
+    const int *bucket = t->pos + (size_t)h * t->depth * 2;
+    int limit = end - i < 258 ? end - i : 258;
+    int best = 0;
+    for (int j = 0; j < t->count[h]; j++) {
+        if (bucket[j] <= min_pos) {
+            continue;
+        }
+        const uint8_t *a = data + bucket[j], *b = data + i;
+        int n = 0;
+        while (n < limit && a[n] == b[n]) {
+            n++;
+        }
+        if (n >= best) {
+            best = n;
+            *best_pos = bucket[j];
+        }
+    }
+    return best;
+}
+
+// Deflates data[start, end) as one fixed huffman block with matches reaching
+// back into the 32k before start. A chunk that isn't last ends in a sync
+// flush so the next one starts on a byte boundary.
+void deflateChunk(const uint8_t *data, int len, int start, int end, bool last, DeflateHash *t, ByteBuf *out) {
+    static const uint16_t len_base[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258,259 };
+    static const uint8_t len_extra[] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+    static const uint16_t dist_base[] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,32768 };
+    static const uint8_t dist_extra[] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+    size_t begin = out->len;
+    DeflateBits d = { out };
+
+    memset(t->count, 0, DEFLATE_HASH * sizeof(int));
+    for (int i = start > DEFLATE_WINDOW ? start - DEFLATE_WINDOW : 0; i < start && i + 2 < len; i++) {
+        deflateInsert(t, deflateHash(data + i), i);
+    }
+
+    deflatePut(&d, last, 1);
+    deflatePut(&d, 1, 2);
+    int i = start;
+    while (i < end - 3) {
+        int best_pos = 0;
+        int best = deflateLongest(t, data, i, end, i - DEFLATE_WINDOW, &best_pos);
+        deflateInsert(t, deflateHash(data + i), i);
+        if (best >= 3) {
+            // lazy matching, emit a literal if the next byte starts a longer match
+            int next_pos;
+            if (deflateLongest(t, data, i + 1, end, i + 1 - DEFLATE_WINDOW, &next_pos) > best) {
+                best = 0;
+            }
+        }
+        if (best >= 3) {
+            int dist = i - best_pos;
+            int j = 0;
+            while (best > len_base[j + 1] - 1) {
+                j++;
+            }
+            deflatePutSym(&d, 257 + j);
+            deflatePut(&d, best - len_base[j], len_extra[j]);
+            j = 0;
+            while (dist > dist_base[j + 1] - 1) {
+                j++;
+            }
+            deflatePutRev(&d, j, 5);
+            deflatePut(&d, dist - dist_base[j], dist_extra[j]);
+            i += best;
+        }
+        else {
+            deflatePutSym(&d, data[i]);
+            i++;
+        }
+    }
+    for (; i < end; i++) {
+        deflatePutSym(&d, data[i]);
+    }
+    deflatePutSym(&d, 256);
+    if (!last) {
+        deflatePut(&d, 0, 3);
+    }
+    deflatePut(&d, 0, (8 - d.nbits) & 7);
+    if (!last) {
+        static const uint8_t sync[4] = { 0x00, 0x00, 0xFF, 0xFF };
+        bufPut(out, sync, 4);
+    }
+
+    // fall back to stored blocks when the data didn't compress
+    int n = end - start;
+    if (out->len - begin > (size_t)n + (n / 65535 + 1) * 5) {
+        out->len = begin;
+        for (int pos = start; pos < end;) {
+            int block = end - pos < 65535 ? end - pos : 65535;
+            uint8_t hdr[5] = { last && pos + block == end, block & 0xFF, block >> 8, ~block & 0xFF, (~block >> 8) & 0xFF };
+            bufPut(out, hdr, 5);
+            bufPut(out, data + pos, block);
+            pos += block;
+        }
+    }
+}
+
+typedef struct {
+    const uint8_t *data;
+    int len;
+    int quality;
+    int chunks;
+    ByteBuf *out;
+    uint32_t *adler;
+} DeflateJob;
+
+void deflateChunks(void *ctx, int start, int end) {
+    DeflateJob *job = ctx;
+    DeflateHash t = { malloc((size_t)DEFLATE_HASH * job->quality * 2 * sizeof(int)), malloc(DEFLATE_HASH * sizeof(int)), job->quality };
+    for (int i = start; i < end; i++) {
+        int from = i * DEFLATE_CHUNK;
+        int to = job->len - from < DEFLATE_CHUNK ? job->len : from + DEFLATE_CHUNK;
+        deflateChunk(job->data, job->len, from, to, i == job->chunks - 1, &t, &job->out[i]);
+        job->adler[i] = adler32(1, job->data + from, to - from);
+    }
+    free(t.pos);
+    free(t.count);
+}
+
+// Stands in for stbi_zlib_compress. The input is cut into chunks deflated in
+// parallel, each primed with the 32k before it as a preset dictionary, then
+// stitched into one stream with a combined Adler-32.
+unsigned char* zlibCompress(unsigned char *data, int data_len, int *out_len, int quality) {
+    if (quality < 5) {
+        quality = 5;
+    }
+    int chunks = (data_len + DEFLATE_CHUNK - 1) / DEFLATE_CHUNK;
+    ByteBuf *parts = calloc(chunks, sizeof(ByteBuf));
+    uint32_t *adler = malloc(chunks * sizeof(uint32_t));
+    DeflateJob job = { data, data_len, quality, chunks, parts, adler };
+    parallelFor(chunks, deflateChunks, &job);
+
+    ByteBuf out = { 0 };
+    static const uint8_t header[2] = { 0x78, 0x5E };
+    bufPut(&out, header, 2);
+    if (chunks == 0) {
+        // final fixed huffman block holding only its end code
+        static const uint8_t empty[2] = { 0x03, 0x00 };
+        bufPut(&out, empty, 2);
+    }
+    uint32_t sum = 1;
+    for (int i = 0; i < chunks; i++) {
+        bufPut(&out, parts[i].data, parts[i].len);
+        free(parts[i].data);
+        int n = i == chunks - 1 ? data_len - i * DEFLATE_CHUNK : DEFLATE_CHUNK;
+        sum = adler32Combine(sum, adler[i], n);
+    }
+    pngPut32(&out, sum);
+    free(parts);
+    free(adler);
+    *out_len = out.len;
+    return out.data;
+}
+
+int pngBestFilter(const uint8_t *pixels, int stride, int w, int h, int y, int c, signed char *line) {
+    int best = 0, best_est = INT32_MAX;
+    for (int filter = 0; filter < 5; filter++) {
+        stbiw__encode_png_line((uint8_t*)pixels, stride, w, h, y, c, filter, line);
+        int est = 0;
+        for (int i = 0; i < w * c; i++) {
+            est += abs(line[i]);
+        }
+        if (est < best_est) {
+            best_est = est;
+            best = filter;
+        }
+    }
+    return best;
+}
+
+typedef struct {
+    const uint8_t *pixels;
+    int stride, w, h, c;
+    int filter, band;
+    uint8_t *filt;
+} FilterJob;
+
+// Filters one band of rows straight into the shared buffer, each band picks
+// its own filter so workers never depend on each other
+void filterRows(void *ctx, int start, int end) {
+    FilterJob *job = ctx;
+    int row_len = job->w * job->c;
+    int y_end = end * job->band < job->h ? end * job->band : job->h;
+    signed char *scratch = job->filter < 0 ? malloc(row_len) : NULL;
+    int filter = job->filter;
+    for (int y = start * job->band; y < y_end; y++) {
+        if (job->filter < 0 && y % job->band == 0) {
+            filter = pngBestFilter(job->pixels, job->stride, job->w, job->h, y, job->c, scratch);
+        }
+        uint8_t *row = job->filt + (size_t)y * (row_len + 1);
+        row[0] = filter;
+        stbiw__encode_png_line((uint8_t*)job->pixels, job->stride, job->w, job->h, y, job->c, filter, (signed char*)row + 1);
+    }
+    free(scratch);
+}
+
+// Filters each row with stb's png line filters and deflates the result
+uint8_t* pngCompressWith(const uint8_t *pixels, int stride, int w, int h, int c, const PngTier *t, int *zlen) {
+    if (t->filter == -2) {
+        const PngTier tries[4] = {
+            { NULL, -1, 16, t->quality },
+            { NULL, -1, 1, t->quality },
+            { NULL, 2, 0, t->quality },
+            { NULL, 4, 0, t->quality },
+        };
+        uint8_t *best = NULL;
+        for (int i = 0; i < 4; i++) {
+            int len;
+            uint8_t *zlib = pngCompressWith(pixels, stride, w, h, c, &tries[i], &len);
+            if (!best || len < *zlen) {
+                STBIW_FREE(best);
+                best = zlib;
+                *zlen = len;
+            }
+            else {
+                STBIW_FREE(zlib);
+            }
+        }
+        return best;
+    }
+
+    int row_len = w * c;
+    uint8_t *filt = malloc((size_t)(row_len + 1) * h);
+    FilterJob job = { pixels, stride, w, h, c, t->filter, t->filter < 0 ? t->band : 1, filt };
+    parallelFor((h + job.band - 1) / job.band, filterRows, &job);
+    uint8_t *zlib;
+    if (t->quality == 0)
+        zlib = zlibStore(filt, (row_len + 1) * h, zlen);
+    else
+        zlib = stbi_zlib_compress(filt, (row_len + 1) * h, zlen, t->quality);
+    free(filt);
+    return zlib;
+}
+
+uint8_t* pngCompress(const uint8_t *pixels, int stride, int w, int h, int c, int tier, int *zlen) {
+    return pngCompressWith(pixels, stride, w, h, c, &png_tiers[tier], zlen);
+}
+
+// Returns the bytes written, 0 on failure
+size_t pngSave(const char* path, int w, int h, int c, const uint8_t* img, int tier) {
+    int zlen;
+    uint8_t *zlib = pngCompress(img, w * c, w, h, c, tier, &zlen);
+    if (!zlib) {
+        return 0;
+    }
+    ByteBuf b = { 0 };
+    pngHeader(&b, w, h, c);
+    pngChunk(&b, "IDAT", zlib, zlen);
+    pngChunk(&b, "IEND", NULL, 0);
+    STBIW_FREE(zlib);
+
+    FILE *f = openOutput(path);
+    bool ok = f && fwrite(b.data, 1, b.len, f) == b.len;
+    if (f && fclose(f) != 0) {
+        ok = false;
+    }
+    free(b.data);
+    return ok ? b.len : 0;
+}
+
+typedef struct {
+    EncodeJob base;
+    uint8_t *pixels;
+    Rect rect;
+    int c;
+    int index;
+    int delay_ms;
+    int tier;
+    uint8_t dispose;
+} ApngFrameJob;
+
+typedef struct {
+    FILE *f;
+    int w, h, c;
+    int tier;
+    uint8_t *prev;
+    long actl_pos;
+    int frames;
+    ApngFrameJob *held;
+    bool held_alpha;
+    FrameQueue q;
+} ApngWriter;
+
+void apngEncodeFrame(void *arg) {
+    ApngFrameJob *job = arg;
+    Rect rect = job->rect;
+    ByteBuf *b = &job->base.out;
+    int zlen;
+    double t0 = now();
+    uint8_t *zlib = pngCompress(job->pixels, rect.w * job->c, rect.w, rect.h, job->c, job->tier, &zlen);
+
+    // frame 0 takes one sequence number (its fcTL), every later one takes two
+    int seq = job->index == 0 ? 0 : job->index * 2 - 1;
+    size_t start = pngChunkBegin(b, "fcTL", 26);
+    pngPut32(b, seq);
+    pngPut32(b, rect.w);
+    pngPut32(b, rect.h);
+    pngPut32(b, rect.x);
+    pngPut32(b, rect.y);
+    // gif holds run past what a 16 bit count of milliseconds can say
+    bool cs = job->delay_ms > 65535;
+    pngPut16(b, cs ? job->delay_ms / 10 : job->delay_ms);
+    pngPut16(b, cs ? 100 : 1000);
+    uint8_t ops[2] = { job->dispose, 0 }; // replace the region
+    bufPut(b, ops, 2);
+    pngChunkEnd(b, start);
+
+    if (job->index == 0) {
+        pngChunk(b, "IDAT", zlib, zlen);
+    }
+    else {
+        start = pngChunkBegin(b, "fdAT", zlen + 4);
+        pngPut32(b, seq + 1);
+        bufPut(b, zlib, zlen);
+        pngChunkEnd(b, start);
+    }
+
+    STBIW_FREE(zlib);
+    free(job->pixels);
+    addEncodeStats(t0, (size_t)rect.w * rect.h * job->c, b->len);
+    poolFinish(&job->base.pending);
+}
+
+void apngWriteActl(ByteBuf *b, int frames) {
+    size_t start = pngChunkBegin(b, "acTL", 8);
+    pngPut32(b, frames);
+    pngPut32(b, 0); // loop forever
+    pngChunkEnd(b, start);
+}
+
+bool apngBegin(ApngWriter *aw, const char* path, int w, int h, int c, int tier) {
+    memset(aw, 0, sizeof(*aw));
+    aw->f = openOutput(path);
+    if (!aw->f) {
+        return false;
+    }
+    aw->w = w;
+    aw->h = h;
+    aw->c = c;
+    aw->tier = tier;
+    aw->q.f = aw->f;
+
+    // the frame count in acTL gets patched in once the animation is finished
+    ByteBuf b = { 0 };
+    pngHeader(&b, w, h, c);
+    aw->actl_pos = b.len;
+    apngWriteActl(&b, 0);
+    fwrite(b.data, 1, b.len, aw->f);
+    free(b.data);
+    return true;
+}
+
+void apngWriteFrame(ApngWriter *aw, const uint8_t *img, int delay_ms) {
+    // like gif, a frame with alpha has to clear what came before it, so the
+    // previous frame is held back until then to pick its disposal
+    Rect rect = { 0, 0, aw->w, aw->h };
+    bool alpha = frameHasAlpha(img, aw->w, aw->h, aw->c);
+    if (aw->held) {
+        ApngFrameJob *held = aw->held;
+        if (alpha && (held->rect.w != aw->w || held->rect.h != aw->h)) {
+            // disposal only clears the frame's own region, so widen it
+            free(held->pixels);
+            held->pixels = copyRect(aw->prev, aw->w, aw->c, rect);
+            held->rect = rect;
+        }
+        held->dispose = alpha ? 1 : 0; // to transparent black, or left in place
+        queueSubmit(&aw->q, &held->base, apngEncodeFrame);
+    }
+    bool delta = aw->prev && !alpha && !aw->held_alpha;
+    aw->held_alpha = alpha;
+
+    if (!aw->prev) {
+        aw->prev = malloc((size_t)aw->w * aw->h * aw->c);
+    }
+    else if (delta && !frameDiff(aw->prev, img, aw->w, aw->h, aw->c, &rect)) {
+        rect = (Rect){ 0, 0, 1, 1 };
+    }
+    pasteRect(aw->prev, img, aw->w, aw->c, rect);
+
+    ApngFrameJob *job = calloc(1, sizeof(ApngFrameJob));
+    job->pixels = copyRect(img, aw->w, aw->c, rect);
+    job->rect = rect;
+    job->c = aw->c;
+    job->index = aw->frames++;
+    job->delay_ms = delay_ms;
+    job->tier = aw->tier;
+    aw->held = job;
+}
+
+void apngEnd(ApngWriter *aw) {
+    if (aw->held) {
+        queueSubmit(&aw->q, &aw->held->base, apngEncodeFrame);
+        aw->held = NULL;
+    }
+    queueFlush(&aw->q);
+    ByteBuf b = { 0 };
+    pngChunk(&b, "IEND", NULL, 0);
+    fwrite(b.data, 1, b.len, aw->f);
+
+    b.len = 0;
+    apngWriteActl(&b, aw->frames);
+    fseek(aw->f, aw->actl_pos, SEEK_SET);
+    fwrite(b.data, 1, b.len, aw->f);
+    free(b.data);
+
+    fclose(aw->f);
+    free(aw->prev);
+    aw->f = NULL;
+}
+
+
+// Motion jpeg in a plain RIFF avi, so video needs no ffmpeg or temporary frames.
+// Frames are jpeg encoded on the pool and appended in order, then indexed by idx1.
+#define AVI_HEADER_SIZE 224 // RIFF, hdrl list and the movi list header
+
+typedef struct {
+    EncodeJob base;
+    uint8_t *pixels;
+    int w, h, c;
+    int quality;
+    uint32_t *size;
+} AviFrameJob;
+
+typedef struct {
+    FILE *f;
+    int w, h, c;
+    int fps;
+    int quality;
+    uint32_t *sizes;
+    int frames, cap;
+    FrameQueue q;
+} AviWriter;
+
+void aviPut32(ByteBuf *b, uint32_t v) {
+    uint8_t le[4] = { v, v >> 8, v >> 16, v >> 24 };
+    bufPut(b, le, 4);
+}
+
+void aviChunk(ByteBuf *b, const char *id, uint32_t len) {
+    bufPut(b, id, 4);
+    aviPut32(b, len);
+}
+
+void bufWrite(void *context, void *data, int size) {
+    bufPut(context, data, size);
+}
+
+// Everything up to the first frame. Sizes and counts are zero until aviEnd rewrites it.
+void aviHeader(ByteBuf *b, const AviWriter *aw, uint32_t file_len, uint32_t movi_len) {
+    uint32_t largest = 0;
+    for (int i = 0; i < aw->frames; i++) {
+        if (aw->sizes[i] > largest) {
+            largest = aw->sizes[i];
+        }
+    }
+
+    aviChunk(b, "RIFF", file_len ? file_len - 8 : 0);
+    bufPut(b, "AVI ", 4);
+    aviChunk(b, "LIST", 192);
+    bufPut(b, "hdrl", 4);
+
+    aviChunk(b, "avih", 56);
+    aviPut32(b, 1000000 / aw->fps);
+    aviPut32(b, largest * aw->fps);
+    aviPut32(b, 0);
+    aviPut32(b, 0x10); // AVIF_HASINDEX
+    aviPut32(b, aw->frames);
+    aviPut32(b, 0);
+    aviPut32(b, 1);
+    aviPut32(b, largest);
+    aviPut32(b, aw->w);
+    aviPut32(b, aw->h);
+    for (int i = 0; i < 4; i++) {
+        aviPut32(b, 0);
+    }
+
+    aviChunk(b, "LIST", 116);
+    bufPut(b, "strl", 4);
+    aviChunk(b, "strh", 56);
+    bufPut(b, "vidsMJPG", 8);
+    aviPut32(b, 0);
+    aviPut32(b, 0); // priority and language
+    aviPut32(b, 0);
+    aviPut32(b, 1);
+    aviPut32(b, aw->fps);
+    aviPut32(b, 0);
+    aviPut32(b, aw->frames);
+    aviPut32(b, largest);
+    aviPut32(b, 0xFFFFFFFF);
+    aviPut32(b, 0);
+    gifPut16(b, 0);
+    gifPut16(b, 0);
+    gifPut16(b, aw->w);
+    gifPut16(b, aw->h);
+
+    // BITMAPINFOHEADER
+    aviChunk(b, "strf", 40);
+    aviPut32(b, 40);
+    aviPut32(b, aw->w);
+    aviPut32(b, aw->h);
+    gifPut16(b, 1);
+    gifPut16(b, 24);
+    bufPut(b, "MJPG", 4);
+    aviPut32(b, (uint32_t)aw->w * aw->h * 3);
+    for (int i = 0; i < 4; i++) {
+        aviPut32(b, 0);
+    }
+
+    aviChunk(b, "LIST", movi_len);
+    bufPut(b, "movi", 4);
+}
+
+void aviEncodeFrame(void *arg) {
+    AviFrameJob *job = arg;
+    ByteBuf *b = &job->base.out;
+    double t0 = now();
+    aviChunk(b, "00dc", 0);
+    stbi_write_jpg_to_func(bufWrite, b, job->w, job->h, job->c, job->pixels, job->quality);
+
+    uint32_t len = b->len - 8;
+    uint8_t le[4] = { len, len >> 8, len >> 16, len >> 24 };
+    memcpy(b->data + 4, le, 4);
+    if (len & 1) {
+        // chunks are word aligned
+        bufPut(b, "", 1);
+    }
+    *job->size = len;
+
+    free(job->pixels);
+    addEncodeStats(t0, (size_t)job->w * job->h * job->c, b->len);
+    poolFinish(&job->base.pending);
+}
+
+bool aviBegin(AviWriter *aw, const char* path, int w, int h, int c, int fps, int quality) {
+    memset(aw, 0, sizeof(*aw));
+    aw->f = openOutput(path);
+    if (!aw->f) {
+        return false;
+    }
+    aw->w = w;
+    aw->h = h;
+    aw->c = c;
+    aw->fps = fps > 0 ? fps : 20;
+    aw->quality = quality;
+    aw->q.f = aw->f;
+
+    ByteBuf b = { 0 };
+    aviHeader(&b, aw, 0, 0);
+    fwrite(b.data, 1, b.len, aw->f);
+    free(b.data);
+    return true;
+}
+
+void aviWriteFrame(AviWriter *aw, const uint8_t *img) {
+    if (aw->frames == aw->cap) {
+        // frames in flight still write their sizes into the old array
+        queueFlush(&aw->q);
+        aw->cap = aw->cap ? aw->cap * 2 : 256;
+        aw->sizes = realloc(aw->sizes, aw->cap * sizeof(uint32_t));
+    }
+    size_t len = (size_t)aw->w * aw->h * aw->c;
+    AviFrameJob *job = calloc(1, sizeof(AviFrameJob));
+    job->pixels = malloc(len);
+    memcpy(job->pixels, img, len);
+    job->w = aw->w;
+    job->h = aw->h;
+    job->c = aw->c;
+    job->quality = aw->quality;
+    job->size = &aw->sizes[aw->frames++];
+    queueSubmit(&aw->q, &job->base, aviEncodeFrame);
+}
+
+void aviEnd(AviWriter *aw) {
+    queueFlush(&aw->q);
+
+    // idx1 offsets count from the movi fourcc
+    ByteBuf b = { 0 };
+    uint32_t offset = 4;
+    aviChunk(&b, "idx1", aw->frames * 16);
+    for (int i = 0; i < aw->frames; i++) {
+        bufPut(&b, "00dc", 4);
+        aviPut32(&b, 0x10); // AVIIF_KEYFRAME
+        aviPut32(&b, offset);
+        aviPut32(&b, aw->sizes[i]);
+        offset += 8 + ((aw->sizes[i] + 1) & ~1u);
+    }
+    fwrite(b.data, 1, b.len, aw->f);
+    uint32_t movi_len = offset;
+    uint32_t file_len = AVI_HEADER_SIZE - 4 + movi_len + b.len;
+
+    b.len = 0;
+    aviHeader(&b, aw, file_len, movi_len);
+    fseek(aw->f, 0, SEEK_SET);
+    fwrite(b.data, 1, b.len, aw->f);
+    free(b.data);
+
+    fclose(aw->f);
+    free(aw->sizes);
+    aw->f = NULL;
+}
+
+
+// YUV4MPEG2: a one line header, then a FRAME line and raw 4:2:0 planes per frame,
+// which x264 or ffmpeg can read straight from a pipe without decoding anything.
+// Colors are BT.601 limited range, the same as ffmpeg's default rgb to yuv420p.
+typedef struct {
+    FILE *f;
+    int w, h, c;
+    uint8_t *planes;
+    size_t y_len, uv_len;
+} Y4mWriter;
+
+typedef struct {
+    const uint8_t *img;
+    uint8_t *y, *u, *v;
+    int w, h, c;
+} YuvJob;
+
+static inline void rgbAt(const uint8_t *p, int c, int *r, int *g, int *b) {
+    if (c < 3) {
+        *r = *g = *b = p[0];
+    }
+    else {
+        *r = p[0];
+        *g = p[1];
+        *b = p[2];
+    }
+}
+
+#ifdef __SSE2__
+// Four pixels as 32 bit rgbx lanes, reading exactly 4 * c bytes
+static inline __m128i yuvLoad4(const uint8_t *p, int c) {
+    if (c == 4) {
+        return _mm_loadu_si128((const __m128i*)p);
+    }
+    int32_t tail;
+    memcpy(&tail, p + 8, 4);
+    __m128i v = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)p), _mm_cvtsi32_si128(tail));
+    // pixel i moves from byte 3i to byte 4i
+    __m128i p0 = _mm_and_si128(v, _mm_setr_epi32(0xFFFFFF, 0, 0, 0));
+    __m128i p1 = _mm_and_si128(_mm_slli_si128(v, 1), _mm_setr_epi32(0, 0xFFFFFF, 0, 0));
+    __m128i p2 = _mm_and_si128(_mm_slli_si128(v, 2), _mm_setr_epi32(0, 0, 0xFFFFFF, 0));
+    __m128i p3 = _mm_and_si128(_mm_slli_si128(v, 3), _mm_setr_epi32(0, 0, 0, 0xFFFFFF));
+    return _mm_or_si128(_mm_or_si128(p0, p1), _mm_or_si128(p2, p3));
+}
+
+// r*k0 + g*k1 + b*k2 for four pixels, lo and hi holding two 16 bit rgbx pixels each
+static inline __m128i yuvDot(__m128i lo, __m128i hi, __m128i k) {
+    __m128 a = _mm_castsi128_ps(_mm_madd_epi16(lo, k));
+    __m128 b = _mm_castsi128_ps(_mm_madd_epi16(hi, k));
+    return _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))),
+                         _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+// Eight pixels from each of two rows: eight luma per row and four of each chroma
+static void yuvBlock8(const uint8_t *p0, const uint8_t *p1, int c, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ky = _mm_setr_epi16(66, 129, 25, 0, 66, 129, 25, 0);
+    const __m128i ku = _mm_setr_epi16(-38, -74, 112, 0, -38, -74, 112, 0);
+    const __m128i kv = _mm_setr_epi16(112, -94, -18, 0, 112, -94, -18, 0);
+    const __m128i ybias = _mm_set1_epi32(128 + (16 << 8));
+    const __m128i cbias = _mm_set1_epi32(512 + (128 << 10));
+    __m128i px[4] = { yuvLoad4(p0, c), yuvLoad4(p0 + 4 * c, c), yuvLoad4(p1, c), yuvLoad4(p1 + 4 * c, c) };
+    __m128i lo[4], hi[4];
+    for (int i = 0; i < 4; i++) {
+        lo[i] = _mm_unpacklo_epi8(px[i], zero);
+        hi[i] = _mm_unpackhi_epi8(px[i], zero);
+    }
+
+    for (int r = 0; r < 2; r++) {
+        __m128i a = _mm_srai_epi32(_mm_add_epi32(yuvDot(lo[r * 2], hi[r * 2], ky), ybias), 8);
+        __m128i b = _mm_srai_epi32(_mm_add_epi32(yuvDot(lo[r * 2 + 1], hi[r * 2 + 1], ky), ybias), 8);
+        __m128i l = _mm_packs_epi32(a, b);
+        _mm_storel_epi64((__m128i*)(r ? y1 : y0), _mm_packus_epi16(l, l));
+    }
+
+    // 2x2 sums: the two rows added, then neighbouring pixels
+    __m128i q[2];
+    for (int i = 0; i < 2; i++) {
+        __m128i s_lo = _mm_add_epi16(lo[i], lo[i + 2]);
+        __m128i s_hi = _mm_add_epi16(hi[i], hi[i + 2]);
+        q[i] = _mm_add_epi16(_mm_unpacklo_epi64(s_lo, s_hi), _mm_unpackhi_epi64(s_lo, s_hi));
+    }
+    __m128i cu = _mm_srai_epi32(_mm_add_epi32(yuvDot(q[0], q[1], ku), cbias), 10);
+    __m128i cv = _mm_srai_epi32(_mm_add_epi32(yuvDot(q[0], q[1], kv), cbias), 10);
+    __m128i uv = _mm_packs_epi32(cu, cv);
+    uv = _mm_packus_epi16(uv, uv);
+    int32_t out = _mm_cvtsi128_si32(uv);
+    memcpy(u, &out, 4);
+    out = _mm_cvtsi128_si32(_mm_srli_si128(uv, 4));
+    memcpy(v, &out, 4);
+}
+#endif
+
+// Converts pairs of rows, a past the last row of an odd height image repeating it
+void yuvRows(void *ctx, int start, int end) {
+    YuvJob *job = ctx;
+    int w = job->w, c = job->c, cw = (w + 1) / 2;
+    for (int j = start; j < end; j++) {
+        int row0 = j * 2, row1 = row0 + 1 < job->h ? row0 + 1 : row0;
+        const uint8_t *p0 = job->img + (size_t)row0 * w * c;
+        const uint8_t *p1 = job->img + (size_t)row1 * w * c;
+        uint8_t *y0 = job->y + (size_t)row0 * w;
+        uint8_t *y1 = job->y + (size_t)row1 * w;
+        uint8_t *u = job->u + (size_t)j * cw;
+        uint8_t *v = job->v + (size_t)j * cw;
+        int x = 0;
+#ifdef __SSE2__
+        if (c >= 3) {
+            for (; x + 8 <= w; x += 8) {
+                yuvBlock8(p0 + x * c, p1 + x * c, c, y0 + x, y1 + x, u + x / 2, v + x / 2);
+            }
+        }
+#endif
+        for (; x < w; x += 2) {
+            int x1 = x + 1 < w ? x + 1 : x;
+            const uint8_t *px[4] = { p0 + x * c, p0 + x1 * c, p1 + x * c, p1 + x1 * c };
+            uint8_t *luma[4] = { y0 + x, y0 + x1, y1 + x, y1 + x1 };
+            int sr = 0, sg = 0, sb = 0;
+            for (int k = 0; k < 4; k++) {
+                int r, g, b;
+                rgbAt(px[k], c, &r, &g, &b);
+                *luma[k] = (66 * r + 129 * g + 25 * b + 128 + (16 << 8)) >> 8;
+                sr += r;
+                sg += g;
+                sb += b;
+            }
+            u[x / 2] = (-38 * sr - 74 * sg + 112 * sb + 512 + (128 << 10)) >> 10;
+            v[x / 2] = (112 * sr - 94 * sg - 18 * sb + 512 + (128 << 10)) >> 10;
+        }
+    }
+}
+
+bool y4mBegin(Y4mWriter *yw, const char* path, int w, int h, int c, int fps) {
+    memset(yw, 0, sizeof(*yw));
+    yw->f = openOutput(path);
+    if (!yw->f) {
+        return false;
+    }
+    yw->w = w;
+    yw->h = h;
+    yw->c = c;
+    yw->y_len = (size_t)w * h;
+    yw->uv_len = (size_t)((w + 1) / 2) * ((h + 1) / 2);
+    yw->planes = malloc(yw->y_len + yw->uv_len * 2);
+    fprintf(yw->f, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", w, h, fps > 0 ? fps : 20);
+    return true;
+}
+
+void y4mWriteFrame(Y4mWriter *yw, const uint8_t *img) {
+    double t0 = now();
+    YuvJob job = { img, yw->planes, yw->planes + yw->y_len, yw->planes + yw->y_len + yw->uv_len, yw->w, yw->h, yw->c };
+    parallelFor((yw->h + 1) / 2, yuvRows, &job);
+    fputs("FRAME\n", yw->f);
+    fwrite(yw->planes, 1, yw->y_len + yw->uv_len * 2, yw->f);
+    addEncodeStats(t0, (size_t)yw->w * yw->h * yw->c, yw->y_len + yw->uv_len * 2 + 6);
+}
+
+void y4mEnd(Y4mWriter *yw) {
+    fclose(yw->f);
+    free(yw->planes);
+    yw->f = NULL;
+}
+
+
+// Streams y4m or raw yuv420p frames in, converted to rgb with the inverse of the
+// BT.601 limited range matrix the y4m writer uses. "-" reads from stdin.
+typedef struct {
+    FILE *f;
+    bool y4m;
+    int w, h;
+    uint8_t *planes;
+    uint8_t *rgb;
+    size_t y_len, uv_len;
+    int frame;
+} YuvReader;
+
+typedef struct {
+    const uint8_t *y, *u, *v;
+    uint8_t *rgb;
+    int w;
+} RgbJob;
+
+static inline uint8_t clamp8(int v) {
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+#ifdef __SSE2__
+// Eight pixels of one row. Each pixel is stored as four bytes at a three byte
+// step, so the byte after the last pixel gets clobbered and must be written later.
+static void rgbBlock8(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *out) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i k_r = _mm_setr_epi16(298, 409, 298, 409, 298, 409, 298, 409);
+    const __m128i k_gu = _mm_setr_epi16(298, -100, 298, -100, 298, -100, 298, -100);
+    const __m128i k_gv = _mm_setr_epi16(-208, 128, -208, 128, -208, 128, -208, 128);
+    const __m128i k_b = _mm_setr_epi16(298, 516, 298, 516, 298, 516, 298, 516);
+    const __m128i round = _mm_set1_epi32(128);
+    const __m128i one = _mm_set1_epi16(1);
+    int32_t t;
+
+    __m128i yy = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)y), zero), _mm_set1_epi16(16));
+    memcpy(&t, u, 4);
+    __m128i uu = _mm_cvtsi32_si128(t);
+    uu = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_unpacklo_epi8(uu, uu), zero), _mm_set1_epi16(128));
+    memcpy(&t, v, 4);
+    __m128i vv = _mm_cvtsi32_si128(t);
+    vv = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_unpacklo_epi8(vv, vv), zero), _mm_set1_epi16(128));
+
+    __m128i yv_lo = _mm_unpacklo_epi16(yy, vv), yv_hi = _mm_unpackhi_epi16(yy, vv);
+    __m128i yu_lo = _mm_unpacklo_epi16(yy, uu), yu_hi = _mm_unpackhi_epi16(yy, uu);
+    __m128i v1_lo = _mm_unpacklo_epi16(vv, one), v1_hi = _mm_unpackhi_epi16(vv, one);
+
+    __m128i r = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yv_lo, k_r), round), 8),
+                                _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yv_hi, k_r), round), 8));
+    __m128i g = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yu_lo, k_gu), _mm_madd_epi16(v1_lo, k_gv)), 8),
+                                _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yu_hi, k_gu), _mm_madd_epi16(v1_hi, k_gv)), 8));
+    __m128i b = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yu_lo, k_b), round), 8),
+                                _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yu_hi, k_b), round), 8));
+
+    __m128i rg = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), _mm_packus_epi16(g, g));
+    __m128i bx = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), zero);
+    __m128i px[2] = { _mm_unpacklo_epi16(rg, bx), _mm_unpackhi_epi16(rg, bx) };
+    for (int i = 0; i < 8; i++) {
+        t = _mm_cvtsi128_si32(px[i / 4]);
+        memcpy(out + i * 3, &t, 4);
+        px[i / 4] = _mm_srli_si128(px[i / 4], 4);
+    }
+}
+#endif
+
+void rgbRows(void *ctx, int start, int end) {
+    RgbJob *job = ctx;
+    int w = job->w, cw = (w + 1) / 2;
+    for (int j = start; j < end; j++) {
+        const uint8_t *y = job->y + (size_t)j * w;
+        const uint8_t *u = job->u + (size_t)(j / 2) * cw;
+        const uint8_t *v = job->v + (size_t)(j / 2) * cw;
+        uint8_t *out = job->rgb + (size_t)j * w * 3;
+        int x = 0;
+#ifdef __SSE2__
+        // stop while a pixel is left over to overwrite the last block's spare byte
+        for (; x + 8 < w; x += 8) {
+            rgbBlock8(y + x, u + x / 2, v + x / 2, out + x * 3);
+        }
+#endif
+        for (; x < w; x++) {
+            int c = 298 * (y[x] - 16), d = u[x / 2] - 128, e = v[x / 2] - 128;
+            out[x * 3] = clamp8((c + 409 * e + 128) >> 8);
+            out[x * 3 + 1] = clamp8((c - 100 * d - 208 * e + 128) >> 8);
+            out[x * 3 + 2] = clamp8((c + 516 * d + 128) >> 8);
+        }
+    }
+}
+
+// Raw yuv420p when w and h are given, otherwise a y4m stream
+// Reads one space separated y4m header field, anything past the buffer is skipped.
+// Returns the character that ended it, '\n' at the end of the header.
+int y4mField(FILE *f, char *field, int size) {
+    int ch, len = 0;
+    while ((ch = getc(f)) != EOF && ch != ' ' && ch != '\n') {
+        if (len < size - 1) {
+            field[len++] = ch;
+        }
+    }
+    field[len] = 0;
+    return ch;
+}
+
+bool y4mHeader(FILE *f, int *w, int *h) {
+    char field[32];
+    if (y4mField(f, field, sizeof(field)) != ' ' || strcmp(field, "YUV4MPEG2") != 0) {
+        return false;
+    }
+    // fields are keyed by their first letter, X tags and the rest are skipped whatever their length
+    int end;
+    do {
+        end = y4mField(f, field, sizeof(field));
+        if (field[0] == 'W') {
+            *w = atoi(field + 1);
+        }
+        else if (field[0] == 'H') {
+            *h = atoi(field + 1);
+        }
+        else if (field[0] == 'C' && strcmp(field, "C420") != 0 && strcmp(field, "C420jpeg") != 0 &&
+            strcmp(field, "C420paldv") != 0 && strcmp(field, "C420mpeg2") != 0) {
+            fprintf(stderr, "Only 8 bit 4:2:0 y4m is supported, not %s\n", field + 1);
+            return false;
+        }
+    } while (end == ' ');
+    return end == '\n' && *w > 0 && *h > 0;
+}
+
+bool yuvOpen(YuvReader *r, const char* path, int w, int h) {
+    memset(r, 0, sizeof(*r));
+    r->f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!r->f) {
+        return false;
+    }
+    if (w <= 0 || h <= 0) {
+        w = h = 0;
+        if (!y4mHeader(r->f, &w, &h)) {
+            if (r->f != stdin) {
+                fclose(r->f);
+            }
+            return false;
+        }
+        r->y4m = true;
+    }
+    r->w = w;
+    r->h = h;
+    r->y_len = (size_t)w * h;
+    r->uv_len = (size_t)((w + 1) / 2) * ((h + 1) / 2);
+    r->planes = malloc(r->y_len + r->uv_len * 2);
+    r->rgb = malloc(r->y_len * 3);
+    return true;
+}
+
+// Returns the next frame as rgb, or NULL at the end of the stream.
+// The buffer belongs to the reader and is only valid until the next call.
+uint8_t* yuvNextFrame(YuvReader *r) {
+    if (r->y4m) {
+        // FRAME, possibly with parameters we have no use for
+        int ch = getc(r->f);
+        if (ch != 'F') {
+            return NULL;
+        }
+        while (ch != '\n' && ch != EOF) {
+            ch = getc(r->f);
+        }
+    }
+    if (fread(r->planes, 1, r->y_len + r->uv_len * 2, r->f) != r->y_len + r->uv_len * 2) {
+        return NULL;
+    }
+    RgbJob job = { r->planes, r->planes + r->y_len, r->planes + r->y_len + r->uv_len, r->rgb, r->w };
+    parallelFor(r->h, rgbRows, &job);
+    r->frame++;
+    return r->rgb;
+}
+
+void yuvClose(YuvReader *r) {
+    if (r->f && r->f != stdin) {
+        fclose(r->f);
+    }
+    free(r->planes);
+    free(r->rgb);
+}
+
+
+// QOI ("Quite OK Image") codec, much faster than deflate at a reasonable size.
+// Both directions work a few rows at a time so frames can be streamed.
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xC0
+#define QOI_OP_RGB 0xFE
+#define QOI_OP_RGBA 0xFF
+#define QOI_HASH(p) (((p)[0] * 3 + (p)[1] * 5 + (p)[2] * 7 + (p)[3] * 11) % 64)
+#define QOI_BUF_SIZE 65536
+#define QOI_PIXELS_MAX 400000000u
+
+typedef struct {
+    FILE *f;
+    int w, h, c;
+    uint8_t index[64][4];
+    uint8_t px[4];
+    int run;
+    uint8_t buf[QOI_BUF_SIZE];
+    int len;
+    int pos;
+    size_t written;
+} QoiCodec;
+
+// Writes the header, gray images are stored as rgb(a) since qoi has no gray mode
+void qoiEncodeBegin(QoiCodec *q, FILE *f, int w, int h, int c) {
+    memset(q, 0, sizeof(*q));
+    q->f = f;
+    q->w = w;
+    q->h = h;
+    q->c = c;
+    q->px[3] = 255;
+    uint8_t header[14] = { 'q', 'o', 'i', 'f', w >> 24, w >> 16, w >> 8, w, h >> 24, h >> 16, h >> 8, h, c == 2 || c == 4 ? 4 : 3, 0 };
+    q->written = fwrite(header, 1, 14, f);
+}
+
+void qoiEncodeRows(QoiCodec *q, const uint8_t *rows, int n) {
+    size_t count = (size_t)q->w * n;
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *src = rows + i * q->c;
+        uint8_t px[4];
+        if (q->c >= 3) {
+            px[0] = src[0];
+            px[1] = src[1];
+            px[2] = src[2];
+            px[3] = q->c == 4 ? src[3] : 255;
+        }
+        else {
+            px[0] = px[1] = px[2] = src[0];
+            px[3] = q->c == 2 ? src[1] : 255;
+        }
+
+        if (q->len > QOI_BUF_SIZE - 8) {
+            q->written += fwrite(q->buf, 1, q->len, q->f);
+            q->len = 0;
+        }
+
+        if (memcmp(px, q->px, 4) == 0) {
+            if (++q->run == 62) {
+                q->buf[q->len++] = QOI_OP_RUN | (q->run - 1);
+                q->run = 0;
+            }
+            continue;
+        }
+        if (q->run > 0) {
+            q->buf[q->len++] = QOI_OP_RUN | (q->run - 1);
+            q->run = 0;
+        }
+
+        int hash = QOI_HASH(px);
+        if (memcmp(q->index[hash], px, 4) == 0) {
+            q->buf[q->len++] = QOI_OP_INDEX | hash;
+        }
+        else {
+            memcpy(q->index[hash], px, 4);
+            if (px[3] == q->px[3]) {
+                int8_t dr = px[0] - q->px[0];
+                int8_t dg = px[1] - q->px[1];
+                int8_t db = px[2] - q->px[2];
+                int8_t dr_dg = dr - dg;
+                int8_t db_dg = db - dg;
+                if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2) {
+                    q->buf[q->len++] = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+                }
+                else if (dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32 && db_dg > -9 && db_dg < 8) {
+                    q->buf[q->len++] = QOI_OP_LUMA | (dg + 32);
+                    q->buf[q->len++] = (dr_dg + 8) << 4 | (db_dg + 8);
+                }
+                else {
+                    q->buf[q->len++] = QOI_OP_RGB;
+                    memcpy(q->buf + q->len, px, 3);
+                    q->len += 3;
+                }
+            }
+            else {
+                q->buf[q->len++] = QOI_OP_RGBA;
+                memcpy(q->buf + q->len, px, 4);
+                q->len += 4;
+            }
+        }
+        memcpy(q->px, px, 4);
+    }
+}
+
+void qoiEncodeEnd(QoiCodec *q) {
+    // room for the last run byte and the end marker
+    if (q->len > QOI_BUF_SIZE - 9) {
+        q->written += fwrite(q->buf, 1, q->len, q->f);
+        q->len = 0;
+    }
+    if (q->run > 0) {
+        q->buf[q->len++] = QOI_OP_RUN | (q->run - 1);
+    }
+    static const uint8_t end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    memcpy(q->buf + q->len, end, 8);
+    q->written += fwrite(q->buf, 1, q->len + 8, q->f);
+    q->len = 0;
+}
+
+// Reads the header, rows come out with the stored channel count (3 or 4)
+bool qoiDecodeBegin(QoiCodec *q, FILE *f) {
+    uint8_t header[14];
+    memset(q, 0, sizeof(*q));
+    if (fread(header, 1, 14, f) != 14 || memcmp(header, "qoif", 4) != 0) {
+        return false;
+    }
+    uint32_t w = (uint32_t)header[4] << 24 | header[5] << 16 | header[6] << 8 | header[7];
+    uint32_t h = (uint32_t)header[8] << 24 | header[9] << 16 | header[10] << 8 | header[11];
+    // same pixel limit as the reference decoder, keeps a bad header from asking for gigabytes
+    if (w == 0 || h == 0 || h >= QOI_PIXELS_MAX / w) {
+        return false;
+    }
+    q->f = f;
+    q->w = w;
+    q->h = h;
+    q->c = header[12];
+    q->px[3] = 255;
+    return q->c == 3 || q->c == 4;
+}
+
+static inline uint8_t qoiNext(QoiCodec *q) {
+    if (q->pos == q->len) {
+        q->len = fread(q->buf, 1, QOI_BUF_SIZE, q->f);
+        q->pos = 0;
+        if (q->len == 0) {
+            return 0;
+        }
+    }
+    return q->buf[q->pos++];
+}
+
+void qoiDecodeRows(QoiCodec *q, uint8_t *rows, int n) {
+    size_t count = (size_t)q->w * n;
+    for (size_t i = 0; i < count; i++) {
+        if (q->run > 0) {
+            q->run--;
+        }
+        else {
+            int b1 = qoiNext(q);
+            if (b1 == QOI_OP_RGB) {
+                q->px[0] = qoiNext(q);
+                q->px[1] = qoiNext(q);
+                q->px[2] = qoiNext(q);
+            }
+            else if (b1 == QOI_OP_RGBA) {
+                q->px[0] = qoiNext(q);
+                q->px[1] = qoiNext(q);
+                q->px[2] = qoiNext(q);
+                q->px[3] = qoiNext(q);
+            }
+            else if ((b1 & 0xC0) == QOI_OP_INDEX) {
+                memcpy(q->px, q->index[b1], 4);
+            }
+            else if ((b1 & 0xC0) == QOI_OP_DIFF) {
+                q->px[0] += ((b1 >> 4) & 3) - 2;
+                q->px[1] += ((b1 >> 2) & 3) - 2;
+                q->px[2] += (b1 & 3) - 2;
+            }
+            else if ((b1 & 0xC0) == QOI_OP_LUMA) {
+                int b2 = qoiNext(q);
+                int dg = (b1 & 0x3F) - 32;
+                q->px[0] += dg - 8 + ((b2 >> 4) & 0x0F);
+                q->px[1] += dg;
+                q->px[2] += dg - 8 + (b2 & 0x0F);
+            }
+            else {
+                q->run = b1 & 0x3F;
+            }
+            memcpy(q->index[QOI_HASH(q->px)], q->px, 4);
+        }
+        memcpy(rows + i * q->c, q->px, q->c);
+    }
+}
+
+uint8_t* qoiLoad(FILE *f, int* w, int* h, int* c) {
+    QoiCodec *q = malloc(sizeof(QoiCodec));
+    uint8_t *img = NULL;
+    if (qoiDecodeBegin(q, f)) {
+        *w = q->w;
+        *h = q->h;
+        *c = q->c;
+        img = malloc((size_t)q->w * q->h * q->c);
+        qoiDecodeRows(q, img, q->h);
+    }
+    free(q);
+    return img;
+}
+
+// Returns the bytes written, 0 on failure
+size_t qoiSave(const char* path, int w, int h, int c, const uint8_t* img) {
+    FILE *f = openOutput(path);
+    if (!f) {
+        return 0;
+    }
+    QoiCodec *q = malloc(sizeof(QoiCodec));
+    qoiEncodeBegin(q, f, w, h, c);
+    qoiEncodeRows(q, img, h);
+    qoiEncodeEnd(q);
+    size_t len = q->written;
+    free(q);
+    return fclose(f) == 0 ? len : 0;
+}
+
+
+// Frame pack: all the temporary frames of an animation in one file instead of one
+// file per frame in ./img. Little endian layout: a PackHeader, the frames back to
+// back (raw pixels or whole qoi images), then at header.index an 8 byte aligned
+// table of (offset, length) pairs, one per frame, so readers can mmap and seek.
+#define PACK_PATH "./img/frames.pack"
+#define PACK_VERSION 1
+#define PACK_RAW 0
+#define PACK_QOI 1
+
+typedef struct {
+    char magic[4]; // "PXPK"
+    uint32_t version;
+    uint32_t w, h, c;
+    uint32_t codec;
+    uint32_t frames;
+    uint32_t reserved;
+    uint64_t index;
+} PackHeader;
+
+typedef struct {
+    EncodeJob base;
+    uint8_t *pixels;
+    int w, h, c;
+    int codec;
+    uint64_t *size;
+} PackFrameJob;
+
+typedef struct {
+    FILE *f;
+    int w, h, c;
+    int codec;
+    uint64_t *sizes;
+    int frames, cap;
+    uint64_t reserved;
+    FrameQueue q;
+} PackWriter;
+
+typedef struct {
+    uint8_t *map;
+    size_t len;
+    PackHeader hdr;
+} PackReader;
+
+bool isPack(const char* intermediate) {
+    return strcmp(intermediate, "pack") == 0 || strcmp(intermediate, "rawpack") == 0;
+}
+
+// Keeps blocks allocated a stretch past what has been written so the file stays
+// in few extents, doubling from the bytes actually written. KEEP_SIZE leaves the
+// length alone and packEnd's ftruncate hands back the unused blocks. Only a hint,
+// filesystems without fallocate just grow as frames are written.
+void packReserve(PackWriter *pw, size_t frame_len) {
+    uint64_t pos = ftello(pw->f);
+    if (pos + frame_len <= pw->reserved) {
+        return;
+    }
+    uint64_t bytes = pos * 2 > pos + frame_len ? pos * 2 : pos + frame_len;
+#ifdef __linux__
+    fallocate(fileno(pw->f), FALLOC_FL_KEEP_SIZE, 0, bytes);
+#endif
+    pw->reserved = bytes;
+}
+
+void packEncodeFrame(void *arg) {
+    PackFrameJob *job = arg;
+    ByteBuf *b = &job->base.out;
+    double t0 = now();
+    size_t len = (size_t)job->w * job->h * job->c;
+    if (job->codec == PACK_QOI) {
+        char *data;
+        size_t data_len;
+        FILE *f = open_memstream(&data, &data_len);
+        QoiCodec *q = malloc(sizeof(QoiCodec));
+        qoiEncodeBegin(q, f, job->w, job->h, job->c);
+        qoiEncodeRows(q, job->pixels, job->h);
+        qoiEncodeEnd(q);
+        free(q);
+        fclose(f);
+        b->data = (uint8_t*)data;
+        b->len = b->cap = data_len;
+        free(job->pixels);
+    }
+    else {
+        // the copy taken on submit is written out as is
+        b->data = job->pixels;
+        b->len = b->cap = len;
+    }
+    *job->size = b->len;
+    addEncodeStats(t0, len, b->len);
+    poolFinish(&job->base.pending);
+}
+
+bool packBegin(PackWriter *pw, const char* path, int w, int h, int c, int codec) {
+    memset(pw, 0, sizeof(*pw));
+    pw->f = fopen(path, "wb");
+    if (!pw->f) {
+        return false;
+    }
+    pw->w = w;
+    pw->h = h;
+    pw->c = c;
+    pw->codec = codec;
+    pw->q.f = pw->f;
+
+    // frame count and index get filled in by packEnd
+    PackHeader hdr = { { 'P', 'X', 'P', 'K' }, PACK_VERSION, w, h, c, codec, 0, 0, 0 };
+    fwrite(&hdr, sizeof(hdr), 1, pw->f);
+    return true;
+}
+
+void packWriteFrame(PackWriter *pw, const uint8_t *img) {
+    if (pw->frames == pw->cap) {
+        // frames in flight still write their sizes into the old array
+        queueFlush(&pw->q);
+        pw->cap = pw->cap ? pw->cap * 2 : 256;
+        pw->sizes = realloc(pw->sizes, pw->cap * sizeof(uint64_t));
+    }
+    size_t len = (size_t)pw->w * pw->h * pw->c;
+    // raw frame size, qoi frames come in under it
+    packReserve(pw, len);
+
+    PackFrameJob *job = calloc(1, sizeof(PackFrameJob));
+    job->pixels = malloc(len);
+    memcpy(job->pixels, img, len);
+    job->w = pw->w;
+    job->h = pw->h;
+    job->c = pw->c;
+    job->codec = pw->codec;
+    job->size = &pw->sizes[pw->frames++];
+    queueSubmit(&pw->q, &job->base, packEncodeFrame);
+}
+
+bool packEnd(PackWriter *pw) {
+    queueFlush(&pw->q);
+
+    ByteBuf b = { 0 };
+    uint64_t offset = sizeof(PackHeader);
+    for (int i = 0; i < pw->frames; i++) {
+        offset += pw->sizes[i];
+    }
+    uint64_t index = (offset + 7) & ~(uint64_t)7;
+    uint8_t pad[8] = { 0 };
+    bufPut(&b, pad, index - offset);
+    offset = sizeof(PackHeader);
+    for (int i = 0; i < pw->frames; i++) {
+        uint64_t entry[2] = { offset, pw->sizes[i] };
+        bufPut(&b, entry, sizeof(entry));
+        offset += pw->sizes[i];
+    }
+    fwrite(b.data, 1, b.len, pw->f);
+    free(b.data);
+
+    PackHeader hdr = { { 'P', 'X', 'P', 'K' }, PACK_VERSION, pw->w, pw->h, pw->c, pw->codec, pw->frames, 0, index };
+    fseek(pw->f, 0, SEEK_SET);
+    fwrite(&hdr, sizeof(hdr), 1, pw->f);
+    // drop whatever was reserved past the index
+    bool ok = fflush(pw->f) == 0 && ftruncate(fileno(pw->f), index + (uint64_t)pw->frames * 16) == 0;
+    ok = fclose(pw->f) == 0 && ok;
+    free(pw->sizes);
+    pw->f = NULL;
+    return ok;
+}
+
+bool packOpen(PackReader *r, const char* path) {
+    memset(r, 0, sizeof(*r));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PackHeader)) {
+        close(fd);
+        return false;
+    }
+    r->len = st.st_size;
+    r->map = mmap(NULL, r->len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r->map == MAP_FAILED) {
+        r->map = NULL;
+        return false;
+    }
+    madvise(r->map, r->len, MADV_SEQUENTIAL);
+    memcpy(&r->hdr, r->map, sizeof(PackHeader));
+    if (memcmp(r->hdr.magic, "PXPK", 4) != 0 || r->hdr.version != PACK_VERSION || r->hdr.index > r->len ||
+        (r->len - r->hdr.index) / 16 < r->hdr.frames) {
+        munmap(r->map, r->len);
+        r->map = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Returns the pixels of frame i and sets *c to their channel count. Raw frames
+// point into the map, qoi frames are decoded into buf (w * h * 4 bytes).
+const uint8_t* packFrame(PackReader *r, int i, uint8_t *buf, int *c) {
+    uint64_t entry[2];
+    memcpy(entry, r->map + r->hdr.index + (size_t)i * 16, 16);
+    if (entry[0] > r->len || entry[1] > r->len - entry[0]) {
+        return NULL;
+    }
+    if (r->hdr.codec == PACK_RAW) {
+        *c = r->hdr.c;
+        return entry[1] == (uint64_t)r->hdr.w * r->hdr.h * r->hdr.c ? r->map + entry[0] : NULL;
+    }
+    FILE *f = fmemopen(r->map + entry[0], entry[1], "rb");
+    if (!f) {
+        return NULL;
+    }
+    QoiCodec *q = malloc(sizeof(QoiCodec));
+    bool ok = qoiDecodeBegin(q, f) && q->w == (int)r->hdr.w && q->h == (int)r->hdr.h;
+    if (ok) {
+        qoiDecodeRows(q, buf, q->h);
+        *c = q->c;
+    }
+    free(q);
+    fclose(f);
+    return ok ? buf : NULL;
+}
+
+void packClose(PackReader *r) {
+    if (r->map) {
+        munmap(r->map, r->len);
+    }
+}
+
+// Pipes every frame of a pack into ffmpeg as raw video, nothing is decoded twice
+bool packToVideo(const char* path, int fps, const char* output) {
+    static const char *pix_fmts[] = { NULL, "gray", "ya8", "rgb24", "rgba" };
+    PackReader r;
+    if (!packOpen(&r, path)) {
+        return false;
+    }
+    int w = r.hdr.w, h = r.hdr.h;
+    int c = r.hdr.codec == PACK_RAW ? (int)r.hdr.c : r.hdr.c == 2 || r.hdr.c == 4 ? 4 : 3;
+    char cmd[600];
+    snprintf(cmd, sizeof(cmd), "ffmpeg -y -f rawvideo -pix_fmt %s -s %dx%d -framerate %d -i - -c:v libx264 -pix_fmt yuv420p %s",
+        pix_fmts[c], w, h, fps, output);
+    FILE *p = popen(cmd, "w");
+    if (!p) {
+        packClose(&r);
+        return false;
+    }
+    uint8_t *buf = r.hdr.codec == PACK_RAW ? NULL : malloc((size_t)w * h * 4);
+    bool ok = true;
+    for (int i = 0; i < (int)r.hdr.frames && ok; i++) {
+        int fc;
+        const uint8_t *px = packFrame(&r, i, buf, &fc);
+        ok = px && fwrite(px, 1, (size_t)w * h * c, p) == (size_t)w * h * c;
+    }
+    ok = pclose(p) == 0 && ok;
+    free(buf);
+    packClose(&r);
+    return ok;
+}
+
+// Netpbm: PAM (P7) keeps every channel, PPM/PGM (P6/P5) only rgb or gray. Both are
+// a short text header and raw rows, so handing frames to another tool costs a copy.
+static const char *pam_tupltypes[] = { NULL, "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA" };
+
+bool isPnm(const char* path) {
+    return endsWith(path, ".pam") || endsWith(path, ".ppm") || endsWith(path, ".pgm") || endsWith(path, ".pnm");
+}
+
+// Returns the bytes written, 0 on failure
+size_t pnmSave(const char* path, int w, int h, int c, const uint8_t* img, bool pam) {
+    FILE *f = openOutput(path);
+    if (!f) {
+        return 0;
+    }
+    bool ok = true;
+    size_t len;
+    int out_c = pam ? c : c >= 3 ? 3 : 1;
+    if (pam) {
+        len = fprintf(f, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n", w, h, c, pam_tupltypes[c]);
+    }
+    else {
+        len = fprintf(f, "P%d\n%d %d\n255\n", out_c == 3 ? 6 : 5, w, h);
+    }
+    if (out_c == c) {
+        ok = fwrite(img, (size_t)w * c, h, f) == (size_t)h;
+    }
+    else {
+        // ppm has nowhere to put alpha, so it is dropped a row at a time
+        uint8_t *row = malloc((size_t)w * out_c);
+        for (int y = 0; y < h && ok; y++) {
+            const uint8_t *src = img + (size_t)y * w * c;
+            for (int x = 0; x < w; x++) {
+                memcpy(row + x * out_c, src + x * c, out_c);
+            }
+            ok = fwrite(row, out_c, w, f) == (size_t)w;
+        }
+        free(row);
+    }
+    len += (size_t)w * h * out_c;
+    if (fclose(f) != 0) {
+        ok = false;
+    }
+    return ok ? len : 0;
+}
+
+// Reads a number from a P5/P6 header, skipping whitespace and comments before it
+// and the single whitespace after it
+int pnmNumber(FILE *f) {
+    int ch = getc(f);
+    while (ch == '#' || ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r') {
+        if (ch == '#') {
+            while (ch != '\n' && ch != EOF) {
+                ch = getc(f);
+            }
+        }
+        ch = getc(f);
+    }
+    int v = -1;
+    for (; ch >= '0' && ch <= '9' && v < 1 << 24; ch = getc(f)) {
+        v = (v < 0 ? 0 : v * 10) + ch - '0';
+    }
+    return v;
+}
+
+// 8 bit P5, P6 or P7, read a row at a time so a pipe hands the image over as it arrives
+uint8_t* pnmLoad(FILE *f, int* w, int* h, int* c) {
+    char magic[2];
+    int maxval = -1;
+    *w = *h = *c = -1;
+    if (fread(magic, 1, 2, f) != 2 || magic[0] != 'P') {
+        return NULL;
+    }
+    if (magic[1] == '5' || magic[1] == '6') {
+        *w = pnmNumber(f);
+        *h = pnmNumber(f);
+        maxval = pnmNumber(f);
+        *c = magic[1] == '6' ? 3 : 1;
+    }
+    else if (magic[1] == '7') {
+        char line[256];
+        while (fgets(line, sizeof(line), f) && strncmp(line, "ENDHDR", 6) != 0) {
+            sscanf(line, "WIDTH %d", w);
+            sscanf(line, "HEIGHT %d", h);
+            sscanf(line, "DEPTH %d", c);
+            sscanf(line, "MAXVAL %d", &maxval);
+        }
+    }
+    if (*w <= 0 || *h <= 0 || *c < 1 || *c > 4 || maxval != 255) {
+        return NULL;
+    }
+    size_t stride = (size_t)*w * *c;
+    uint8_t *img = malloc(stride * *h);
+    for (int y = 0; y < *h; y++) {
+        if (fread(img + y * stride, 1, stride, f) != stride) {
+            free(img);
+            return NULL;
+        }
+    }
+    return img;
+}
+
+// Maps a regular file read-only for one front to back pass. NULL for pipes,
+// empty files and anything else mmap won't take, which get read normally.
+uint8_t* mapFile(const char* path, size_t *len) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    uint8_t *map = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            map = NULL;
+        }
+        else {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            *len = st.st_size;
+        }
+    }
+    close(fd);
+    return map;
+}
+
+uint8_t* imageLoad(const char* path, int* w, int* h, int* c) {
+    bool from_stdin = strcmp(path, "-") == 0;
+    int first = from_stdin ? stdinPeek() : 0;
+    size_t len;
+    uint8_t *map = from_stdin ? NULL : mapFile(path, &len);
+
+    // stb has no qoi or pam, those decode from a FILE over the map, stdin or the file
+    uint8_t* (*fileLoad)(FILE *f, int* w, int* h, int* c) = NULL;
+    if (endsWith(path, ".qoi") || first == 'q') {
+        fileLoad = qoiLoad;
+    }
+    else if (isPnm(path) || first == 'P') {
+        fileLoad = pnmLoad;
+    }
+
+    uint8_t *img;
+    if (fileLoad) {
+        FILE *f = from_stdin ? stdin : map ? fmemopen(map, len, "rb") : fopen(path, "rb");
+        img = f ? fileLoad(f, w, h, c) : NULL;
+        if (f && f != stdin) {
+            fclose(f);
+        }
+    }
+    else if (from_stdin) {
+        img = stbi_load_from_callbacks(&stream_io, stdin, w, h, c, 0);
+    }
+    else if (map && len <= INT_MAX) {
+        img = stbi_load_from_memory(map, len, w, h, c, 0);
+    }
+    else {
+        img = stbi_load(path, w, h, c, 0);
+    }
+    if (map) {
+        munmap(map, len);
+    }
+    return img;
+}
+
+void loadImg(const char* path, int* w, int* h, int* c) {
+    og_img = imageLoad(path, w, h, c);
+    if (!og_img) {
+        fprintf(stderr, "Failed to load image\n");
+        exit(1);
+    }
+}
+
+bool isStill(const char* path) {
+    return endsWith(path, ".png") || endsWith(path, ".jpg") || endsWith(path, ".jpeg") || endsWith(path, ".qoi") ||
+        isPnm(path) || endsWith(path, ".bmp") || endsWith(path, ".tga");
+}
+
+// Stills read in order from a directory or a printf pattern like shots/%04d.png.
+// A thread decodes up to `ahead` frames before the effect gets to them and has
+// the kernel read in the files after those while it works.
+typedef struct {
+    uint8_t *img;
+    int w, h, c;
+} SeqFrame;
+
+typedef struct {
+    char **paths;
+    int count;
+    int ahead;
+    SeqFrame *ring;
+    uint8_t *current;
+    int w, h, c;
+    int frame;
+    int decoded;
+    bool stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} SeqReader;
+
+// one %d, optionally zero padded, and no other conversions
+bool isSeqPattern(const char* path) {
+    int conversions = 0;
+    for (const char *p = strchr(path, '%'); p; p = strchr(p, '%')) {
+        p++;
+        if (*p == '%') {
+            p++;
+            continue;
+        }
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+        if (*p != 'd') {
+            return false;
+        }
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+bool isSequence(const char* path) {
+    struct stat st;
+    return isSeqPattern(path) || (stat(path, &st) == 0 && S_ISDIR(st.st_mode));
+}
+
+int seqCompare(const void *a, const void *b) {
+    return strverscmp(*(char* const*)a, *(char* const*)b);
+}
+
+void seqAdvise(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+}
+
+void seqAdd(SeqReader *r, int *cap, const char* path) {
+    if (r->count == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        r->paths = realloc(r->paths, *cap * sizeof(char*));
+    }
+    r->paths[r->count++] = strdup(path);
+}
+
+void* seqDecode(void *arg) {
+    SeqReader *r = arg;
+    for (int i = 0; i < r->ahead && i < r->count; i++) {
+        seqAdvise(r->paths[i]);
+    }
+    for (int i = 0; i < r->count; i++) {
+        // a slot frees up once the frame that was in it has been taken
+        pthread_mutex_lock(&r->lock);
+        while (i - r->frame >= r->ahead && !r->stop) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        bool stop = r->stop;
+        pthread_mutex_unlock(&r->lock);
+        if (stop) {
+            break;
+        }
+        if (i + r->ahead < r->count) {
+            seqAdvise(r->paths[i + r->ahead]);
+        }
+        SeqFrame f;
+        f.img = imageLoad(r->paths[i], &f.w, &f.h, &f.c);
+        pthread_mutex_lock(&r->lock);
+        r->ring[i % r->ahead] = f;
+        r->decoded = i + 1;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+    return NULL;
+}
+
+bool seqOpen(SeqReader *r, const char* path, int ahead) {
+    memset(r, 0, sizeof(*r));
+    int cap = 0;
+    char name[4096];
+    if (isSeqPattern(path)) {
+        // numbering starts anywhere from 0 to 4 and runs until the first gap
+        struct stat st;
+        int i = 0;
+        while (i < 5 && (snprintf(name, sizeof(name), path, i), stat(name, &st) != 0)) {
+            i++;
+        }
+        for (; snprintf(name, sizeof(name), path, i) < (int)sizeof(name) && stat(name, &st) == 0; i++) {
+            seqAdd(r, &cap, name);
+        }
+    }
+    else {
+        DIR *dr = opendir(path);
+        if (!dr) {
+            return false;
+        }
+        struct dirent *de;
+        while ((de = readdir(dr)) != NULL) {
+            if (de->d_name[0] != '.' && isStill(de->d_name) &&
+                snprintf(name, sizeof(name), "%s/%s", path, de->d_name) < (int)sizeof(name)) {
+                seqAdd(r, &cap, name);
             }
         }
+        closedir(dr);
+        // readdir order is whatever the filesystem keeps, frame2 has to come before frame10
+        qsort(r->paths, r->count, sizeof(char*), seqCompare);
     }
-    free(orig_img);
+    if (r->count == 0) {
+        free(r->paths);
+        return false;
+    }
+    r->ahead = ahead;
+    r->ring = malloc(ahead * sizeof(SeqFrame));
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    pthread_create(&r->thread, NULL, seqDecode, r);
+    return true;
 }
 
-void pxlDiffuse(uint8_t* img, int randOffset, int randChance, int tolerance, int xy_mode, int wrap, int size) {
-    int dist, brightness, new_x, new_y;
-    uint8_t* orig_img = malloc(img_w * img_h * img_c);
-    memcpy(orig_img, img, img_w * img_h * img_c);
-    for (int y = 0; y < img_h; y += size) {
-        for (int x = 0; x < img_w; x += size) {
-            brightness = getPxlBrightness(img, x, y);
-            if (brightness < tolerance || rand() % 100 < randChance) {
-                dist = rand() % randOffset;
-                new_x = x + dist;
-                new_y = y + dist;
-                if (wrap) {
-                    new_x = new_x % img_w;
-                    new_y = new_y % img_h;
-                } 
-                for (int i = 0; i < size; i++) {
-                    for (int j = 0; j < size; j++) {
-                        if (xy_mode == 0) {
-                            swapPxl(img, x + i, y + j, new_x + i, y + j);
-                        } else if (xy_mode == 1) {
-                            swapPxl(img, x + i, y + j, x + i, new_y + j);
-                        } else {
-                            swapPxl(img, x + i, y + j, new_x + i, new_y + j);
-                        }
-                    }
-                }
-            }
+// The frame stays valid until the next call
+uint8_t* seqNextFrame(SeqReader *r, int *w, int *h, int *c) {
+    stbi_image_free(r->current);
+    r->current = NULL;
+    if (r->frame == r->count) {
+        return NULL;
+    }
+    pthread_mutex_lock(&r->lock);
+    while (r->decoded <= r->frame) {
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+    SeqFrame f = r->ring[r->frame % r->ahead];
+    r->frame++;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    if (!f.img) {
+        fprintf(stderr, "Failed to load %s\n", r->paths[r->frame - 1]);
+        exit(1);
+    }
+    // every writer is sized from the first frame, later ones have to match it
+    if (r->frame == 1) {
+        r->w = f.w;
+        r->h = f.h;
+        r->c = f.c;
+    }
+    else if (f.w != r->w || f.h != r->h) {
+        fprintf(stderr, "%s is %dx%d, expected %dx%d like the first frame\n", r->paths[r->frame - 1], f.w, f.h, r->w, r->h);
+        exit(1);
+    }
+    else if (f.c != r->c) {
+        f.img = stbi__convert_format(f.img, f.c, r->c, f.w, f.h);
+        f.c = r->c;
+        if (!f.img) {
+            fprintf(stderr, "Failed to load %s\n", r->paths[r->frame - 1]);
+            exit(1);
         }
     }
-    free(orig_img);
+    r->current = f.img;
+    *w = f.w;
+    *h = f.h;
+    *c = f.c;
+    return f.img;
 }
 
+void seqClose(SeqReader *r) {
+    pthread_mutex_lock(&r->lock);
+    r->stop = true;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+    for (int i = r->frame; i < r->decoded; i++) {
+        stbi_image_free(r->ring[i % r->ahead].img);
+    }
+    stbi_image_free(r->current);
+    for (int i = 0; i < r->count; i++) {
+        free(r->paths[i]);
+    }
+    free(r->paths);
+    free(r->ring);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+}
 
-bool endsWith(const char* str, const char* suffix) {
-    if (!str || !suffix) {
-        return 0;
+void saveImg(const char* path, int w, int h, int c, const uint8_t* img, int tier, int quality) {
+    size_t len = 0;
+    double start = now();
+    if (isFormat(path, "qoi")) {
+        len = qoiSave(path, w, h, c, img);
     }
-    size_t str_len = strlen(str);
-    size_t suffix_len = strlen(suffix);
-    if (suffix_len > str_len) {
-        return 0;
+    else if (isFormat(path, "pam") || isFormat(path, "ppm") || isFormat(path, "pgm") || isFormat(path, "pnm")) {
+        len = pnmSave(path, w, h, c, img, isFormat(path, "pam"));
     }
-    return 0 == strncmp(str + str_len - suffix_len, suffix, suffix_len);
+    else if (isFormat(path, "jpg") || isFormat(path, "jpeg") || isFormat(path, "bmp") || isFormat(path, "tga")) {
+        FileSink sink = { openOutput(path), 0 };
+        bool ok = false;
+        if (sink.f && isFormat(path, "bmp")) {
+            ok = stbi_write_bmp_to_func(fileWrite, &sink, w, h, c, img);
+        }
+        else if (sink.f && isFormat(path, "tga")) {
+            ok = stbi_write_tga_to_func(fileWrite, &sink, w, h, c, img);
+        }
+        else if (sink.f) {
+            ok = stbi_write_jpg_to_func(fileWrite, &sink, w, h, c, img, quality);
+        }
+        if (sink.f && fclose(sink.f) != 0) {
+            ok = false;
+        }
+        len = ok ? sink.len : 0;
+    }
+    else {
+        len = pngSave(path, w, h, c, img, tier);
+    }
+    if (len == 0) {
+        fprintf(stderr, "Failed to save image\n");
+        exit(1);
+    }
+    addEncodeStats(start, (size_t)w * h * c, len);
 }
 
 
-bool isint(char* str) {
-    for (int i = 0; i < strlen(str); i++) {
-        if (str[i] < '0' || str[i] > '9') {
-            return false;
-        }
+static GifWriter gif_out;
+static ApngWriter apng_out;
+static AviWriter avi_out;
+static Y4mWriter y4m_out;
+static PackWriter pack_out;
+static Palette gif_palette;
+static Histogram *gif_hist;
+static bool video_input;
+static int frames_written;
+// Delay of the source frame being processed when the input carries its own timing,
+// 0 when -f sets the pace
+static int src_delay_ms;
+static long src_time_ms;
+
+// Frames fed in here before the first gif frame is written make up the global palette
+void samplePalette(const uint8_t *img, int w, int h, int c) {
+    if (!gif_hist) {
+        gif_hist = calloc(1, sizeof(Histogram));
     }
-    return true;
+    histAddFrame(gif_hist, img, w, h, c);
 }
 
+// Hands one finished frame to the output, either one of the native animation
+// writers or a png in ./img for ffmpeg to pick up
+void writeFrame(Arguments *arguments, const uint8_t *img) {
+    int fr = arguments->frame_rate > 0 ? arguments->frame_rate : 20;
+    bool timed = video_input && src_delay_ms > 0;
+    int delay_ms = timed ? src_delay_ms : (1000 + fr / 2) / fr;
 
-void cleanDir(const char* path) {
-    struct dirent *de;
-    DIR *dr = opendir(path);
-    if (dr == NULL) {
-        mkdir(path, 0777);
-        return;
+    if (isFormat(arguments->output, "gif")) {
+        if (!gif_out.f) {
+            // effects only move pixels around, so the source colors are all the palette needs
+            if (!gif_hist) {
+                samplePalette(og_img, img_w, img_h, img_c);
+            }
+            paletteBuild(&gif_palette, gif_hist);
+            free(gif_hist);
+            gif_hist = NULL;
+            if (!gifBegin(&gif_out, arguments->output, img_w, img_h, &gif_palette, arguments->dither)) {
+                fprintf(stderr, "Failed to open %s\n", arguments->output);
+                exit(1);
+            }
+        }
+        gifWriteFrame(&gif_out, img, img_c, (delay_ms + 5) / 10);
+        frames_written++;
+    }
+    else if (isFormat(arguments->output, "apng")) {
+        if (!apng_out.f && !apngBegin(&apng_out, arguments->output, img_w, img_h, img_c, arguments->png_tier)) {
+            fprintf(stderr, "Failed to open %s\n", arguments->output);
+            exit(1);
+        }
+        apngWriteFrame(&apng_out, img, delay_ms);
+        frames_written++;
     }
     else {
-        while ((de = readdir(dr)) != NULL) {
-            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
-                continue;
+        // the rest play at a constant rate, source frames are held for as many
+        // ticks as their delay covers, or dropped when it doesn't reach the next one
+        int ticks = 1;
+        if (timed) {
+            src_time_ms += src_delay_ms;
+            ticks = (int)((src_time_ms * fr + 500) / 1000) - frames_written;
+            // the first frame always shows, a short one just runs into the next tick
+            if (frames_written == 0 && ticks < 1) {
+                ticks = 1;
             }
-            char file[50];
-            strcpy(file, path);
-            strcat(file, "/");
-            strcat(file, de->d_name);
-            remove(file);
         }
-        closedir(dr);
+        for (int i = 0; i < ticks; i++) {
+            if (isFormat(arguments->output, "avi")) {
+                if (!avi_out.f && !aviBegin(&avi_out, arguments->output, img_w, img_h, img_c, fr, arguments->jpeg_quality)) {
+                    fprintf(stderr, "Failed to open %s\n", arguments->output);
+                    exit(1);
+                }
+                aviWriteFrame(&avi_out, img);
+            }
+            else if (isFormat(arguments->output, "y4m")) {
+                if (!y4m_out.f && !y4mBegin(&y4m_out, arguments->output, img_w, img_h, img_c, fr)) {
+                    fprintf(stderr, "Failed to open %s\n", arguments->output);
+                    exit(1);
+                }
+                y4mWriteFrame(&y4m_out, img);
+            }
+            else if (isPack(arguments->intermediate)) {
+                int codec = strcmp(arguments->intermediate, "rawpack") == 0 ? PACK_RAW : PACK_QOI;
+                if (!pack_out.f && !packBegin(&pack_out, PACK_PATH, img_w, img_h, img_c, codec)) {
+                    fprintf(stderr, "Failed to open %s\n", PACK_PATH);
+                    exit(1);
+                }
+                packWriteFrame(&pack_out, img);
+            }
+            else {
+                char filename[50];
+                sprintf(filename, "./img/%04d.%s", frames_written, arguments->intermediate);
+                saveImg(filename, img_w, img_h, img_c, img, arguments->intermediate_tier, arguments->jpeg_quality);
+            }
+            frames_written++;
+        }
     }
 }
 
-
-void modify(Arguments *arguments) {
-
-    loadImg(arguments->input, &img_w, &img_h, &img_c);
-
-    printf("Loaded image with dimensions %dx%d and %d channels\n", img_w, img_h, img_c);
+void processFrame(Arguments *arguments) {
 
     // Initialize modified image
     uint8_t* mod_img =  malloc(img_w * img_h * img_c);
@@ -239,26 +3797,55 @@ void modify(Arguments *arguments) {
         printf("\r");
         printf("Processing frame %d/%d", i, arguments->iterations);
 
-        if (endsWith(arguments->output, ".gif") || endsWith(arguments->output, ".mp4")) {
-            char filename[50];
-            strcpy(filename, "./img/");
-            char num[5];
-            sprintf(num, "%04d", i);
-            strcat(filename, num);
-            strcat(filename, ".png");
-            saveImg(filename, img_w, img_h, img_c, mod_img);
-        }
+        if (!video_input && isAnimation(arguments->output))
+            writeFrame(arguments, mod_img);
 
         if (arguments->mode != NULL && (strcmp(arguments->mode, "wind") == 0 || strcmp(arguments->mode, "haze") == 0))
             memcpy(mod_img, og_img, img_w * img_h * img_c);
     }
-    if (!endsWith(arguments->output, ".gif") && !endsWith(arguments->output, ".mp4"))
-        saveImg(arguments->output, img_w, img_h, img_c, mod_img);
+    if (video_input)
+        writeFrame(arguments, mod_img);
+    else if (!isAnimation(arguments->output))
+        saveImg(arguments->output, img_w, img_h, img_c, mod_img, arguments->png_tier, arguments->jpeg_quality);
 
     free(mod_img);
+}
+
+void modify(Arguments *arguments) {
+
+    loadImg(arguments->input, &img_w, &img_h, &img_c);
+
+    printf("Loaded image with dimensions %dx%d and %d channels\n", img_w, img_h, img_c);
+
+    processFrame(arguments);
+
     stbi_image_free(og_img);
 }
 
+void modifySequence(Arguments *arguments, const char* path) {
+    SeqReader seq;
+    if (!seqOpen(&seq, path, arguments->read_ahead)) {
+        fprintf(stderr, "Failed to load frames\n");
+        exit(1);
+    }
+    video_input = true;
+    if (isFormat(arguments->output, "gif")) {
+        // stills can be picked out directly, this runs alongside the read-ahead
+        for (int i = 0; i < seq.count; i += PALETTE_FRAME_STRIDE) {
+            loadImg(seq.paths[i], &img_w, &img_h, &img_c);
+            samplePalette(og_img, img_w, img_h, img_c);
+            stbi_image_free(og_img);
+        }
+    }
+    while ((og_img = seqNextFrame(&seq, &img_w, &img_h, &img_c)) != NULL) {
+        processFrame(arguments);
+        printf("\r");
+        printf("Processed frame %d\n", seq.frame);
+        arguments->iterations += arguments->animate_iters;
+    }
+    seqClose(&seq);
+}
+
 int main(int argc, char** argv) {
     int opt;
 
@@ -279,10 +3866,33 @@ int main(int argc, char** argv) {
     arguments.animate_iters = 0;
     arguments.wrap = 0;
     arguments.size = 1;
+    arguments.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    arguments.dither = DITHER_BAYER;
+    arguments.intermediate = "pack";
+    arguments.png_tier = PNG_DEFAULT;
+    arguments.intermediate_tier = PNG_FAST;
+    arguments.jpeg_scale = 1;
+    arguments.jpeg_quality = 90;
+    arguments.yuv_w = 0;
+    arguments.yuv_h = 0;
+    arguments.read_ahead = 4;
+
+    enum { OPT_INTERMEDIATE = 256, OPT_PNG_TIER, OPT_INTERMEDIATE_TIER, OPT_JPEG_SCALE, OPT_JPEG_QUALITY, OPT_YUV_SIZE, OPT_FORMAT, OPT_READ_AHEAD };
+    static struct option long_options[] = {
+        { "intermediate", required_argument, NULL, OPT_INTERMEDIATE },
+        { "png-tier", required_argument, NULL, OPT_PNG_TIER },
+        { "intermediate-tier", required_argument, NULL, OPT_INTERMEDIATE_TIER },
+        { "jpeg-scale", required_argument, NULL, OPT_JPEG_SCALE },
+        { "jpeg-quality", required_argument, NULL, OPT_JPEG_QUALITY },
+        { "yuv-size", required_argument, NULL, OPT_YUV_SIZE },
+        { "format", required_argument, NULL, OPT_FORMAT },
+        { "read-ahead", required_argument, NULL, OPT_READ_AHEAD },
+        { NULL, 0, NULL, 0 }
+    };
 
 
     // Parse arguments
-    while ((opt = getopt(argc, argv, "I:i:o:O:t:f:r:m:a:s:hxyw")) != -1) {
+    while ((opt = getopt_long(argc, argv, "I:i:o:O:t:f:r:m:a:s:j:d:hxyw", long_options, NULL)) != -1) {
         switch (opt) {
             case 'I':
                 if (!isint(optarg)) {
@@ -332,6 +3942,88 @@ int main(int argc, char** argv) {
                 }
                 arguments.size = atoi(optarg);
                 break;
+            case 'j':
+                if (!isint(optarg) || atoi(optarg) < 1) {
+                    fprintf(stderr, "Invalid number of threads\n");
+                    exit(1);
+                }
+                arguments.threads = atoi(optarg);
+                break;
+            case 'd':
+                if (strcmp(optarg, "none") == 0)
+                    arguments.dither = DITHER_NONE;
+                else if (strcmp(optarg, "bayer") == 0)
+                    arguments.dither = DITHER_BAYER;
+                else if (strcmp(optarg, "fs") == 0)
+                    arguments.dither = DITHER_FS;
+                else {
+                    fprintf(stderr, "Invalid dither\n");
+                    exit(1);
+                }
+                break;
+            case OPT_INTERMEDIATE:
+                if (strcmp(optarg, "png") != 0 && strcmp(optarg, "qoi") != 0 && !isPack(optarg)) {
+                    fprintf(stderr, "Invalid intermediate format\n");
+                    exit(1);
+                }
+                arguments.intermediate = optarg;
+                break;
+            case OPT_PNG_TIER:
+            case OPT_INTERMEDIATE_TIER: {
+                int tier = pngTierByName(optarg);
+                if (tier < 0) {
+                    fprintf(stderr, "Invalid png tier\n");
+                    exit(1);
+                }
+                if (opt == OPT_PNG_TIER)
+                    arguments.png_tier = tier;
+                else
+                    arguments.intermediate_tier = tier;
+                break;
+            }
+            case OPT_JPEG_SCALE: {
+                int scale = isint(optarg) ? atoi(optarg) : 0;
+                if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+                    fprintf(stderr, "Invalid jpeg scale\n");
+                    exit(1);
+                }
+                arguments.jpeg_scale = scale;
+                break;
+            }
+            case OPT_JPEG_QUALITY:
+                if (!isint(optarg) || atoi(optarg) < 1 || atoi(optarg) > 100) {
+                    fprintf(stderr, "Invalid jpeg quality\n");
+                    exit(1);
+                }
+                arguments.jpeg_quality = atoi(optarg);
+                break;
+            case OPT_YUV_SIZE:
+                if (sscanf(optarg, "%dx%d", &arguments.yuv_w, &arguments.yuv_h) != 2 || arguments.yuv_w < 1 || arguments.yuv_h < 1) {
+                    fprintf(stderr, "Invalid yuv size\n");
+                    exit(1);
+                }
+                break;
+            case OPT_READ_AHEAD:
+                if (!isint(optarg) || atoi(optarg) < 1) {
+                    fprintf(stderr, "Invalid read ahead\n");
+                    exit(1);
+                }
+                arguments.read_ahead = atoi(optarg);
+                break;
+            case OPT_FORMAT: {
+                static const char *formats[] = { "png", "jpg", "jpeg", "qoi", "pam", "ppm", "pgm", "pnm", "bmp", "tga", "gif", "apng", "avi", "y4m" };
+                stdout_format = NULL;
+                for (int i = 0; i < (int)(sizeof(formats) / sizeof(formats[0])); i++) {
+                    if (strcmp(optarg, formats[i]) == 0) {
+                        stdout_format = formats[i];
+                    }
+                }
+                if (!stdout_format) {
+                    fprintf(stderr, "Invalid format\n");
+                    exit(1);
+                }
+                break;
+            }
             case 'm':
                 arguments.mode = optarg;
                 break;
@@ -356,16 +4048,26 @@ int main(int argc, char** argv) {
                         "  -I iterations: Number of frames to generate (default 50)\n"
                         "  -O offset: Maximum pixel offset (default 2)\n"
                         "  -t tolerance: Minimum brightness to trigger effect (default 128)\n"
-                        "  -f frame_rate: Frame rate of output gif (default 20)\n"
+                        "  -f frame_rate: Frame rate of output, gif input keeps its own frame delays (default 20)\n"
                         "  -r randChance: Chance of effect happening (default 10)\n"
                         "  -m mode: Effect mode bleed/diffuse/wind/haze (default bleed)\n"
                         "  -a animate_iters: animate number of iters for each frame of video/gif (default 0)\n"
                         "  -s size: Size of pixel block (default 1)\n"
+                        "  -d dither: Gif dithering none/bayer/fs (default bayer)\n"
+                        "  -j threads: Worker threads for encoding (default all cores)\n"
                         "  -w: Wrap around image\n"
                         "  -x: Only offset x axis\n"
                         "  -y: Only offset y axis\n"
-                        "  -o output: Output file (default output.gif)\n"
-                        "  -i input: Input file\n"
+                        "  -o output: Output file png/jpg/qoi/pam/ppm/pgm/pnm/bmp/tga/gif/apng/avi/y4m/mp4, - for stdout (default output.gif)\n"
+                        "  -i input: Input file, - for stdin, or a directory/printf pattern (frames/%%04d.png) of stills\n"
+                        "  --format fmt: Format written to - png/jpg/qoi/pam/ppm/pgm/pnm/bmp/tga/gif/apng/avi/y4m (default y4m)\n"
+                        "  --intermediate fmt: Temporary frames for ffmpeg, one png/qoi file each or all in one pack/rawpack file (default pack)\n"
+                        "  --png-tier tier: Png/apng output speed store/fast/default/small (default default)\n"
+                        "  --intermediate-tier tier: Png speed for temporary frames (default fast)\n"
+                        "  --jpeg-scale n: Decode jpg input at 1/n size for quick previews, 1/2/4/8 (default 1)\n"
+                        "  --jpeg-quality q: Jpg/avi output quality 1-100 (default 90)\n"
+                        "  --yuv-size WxH: Read .yuv or - input as raw yuv420p frames of this size\n"
+                        "  --read-ahead n: Stills decoded ahead of the effect for directory/pattern input (default 4)\n"
                         "  -h: Show help\n"
                         "  image: Path to image\n"
                 );
@@ -390,80 +4092,170 @@ int main(int argc, char** argv) {
         arguments.input = argv[optind];
     }
 
+    stbi_set_jpeg_scale_on_load(arguments.jpeg_scale);
+    // tga is only here for fast handoff, so skip the rle pass
+    stbi_write_tga_with_rle = 0;
+
 
     // Set default output file
     if (arguments.output == NULL) {
         arguments.output = "output.gif";
     }
 
+    // frames go to stdout, so everything printed along the way goes to stderr instead
+    if (strcmp(arguments.output, "-") == 0) {
+        fflush(stdout);
+        stdout_out = fdopen(dup(STDOUT_FILENO), "wb");
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        // these go back and patch their headers once every frame is in
+        if ((isFormat("-", "apng") || isFormat("-", "avi")) && fseek(stdout_out, 0, SEEK_CUR) != 0) {
+            fprintf(stderr, "%s output to - needs stdout redirected to a file\n", stdout_format);
+            exit(1);
+        }
+    }
+
     char og_output[50];
     strcpy(og_output, arguments.output);
-    char og_input[50];
-    strcpy(og_input, arguments.input);
 
-    clock_t start = clock();
+    // the calling thread works too, so one fewer worker than requested
+    poolStart(arguments.threads - 1);
+    if (arguments.threads > 1) {
+        // jpgs with restart markers decode their segments on the pool
+        stbi_set_parallel_for(parallelFor);
+    }
+
+    double start = now();
+
+    // stdin is told apart by its first byte, or is raw yuv when given a --yuv-size
+    bool from_stdin = strcmp(arguments.input, "-") == 0;
+    int first = from_stdin ? stdinPeek() : 0;
+    bool yuv_input = endsWith(arguments.input, ".y4m") || endsWith(arguments.input, ".yuv") || (from_stdin && (arguments.yuv_w > 0 || first == 'Y'));
+    bool gif_input = endsWith(arguments.input, ".gif") || (from_stdin && !yuv_input && first == 'G');
 
-    if (endsWith(arguments.input, ".png") || endsWith(arguments.input, ".jpg") || endsWith(arguments.input, ".jpeg")) {
+    if ((isStill(arguments.input) && !isSeqPattern(arguments.input)) || (from_stdin && !yuv_input && !gif_input)) {
         modify(args);
     }
-    else if (endsWith(arguments.input, ".gif") || endsWith(arguments.input, ".mp4")) {
-        cleanDir("./frames");
-        char cmd[500];
-        sprintf(cmd, "ffmpeg -i %s ./frames/%%04d.png", arguments.input);
-        system(cmd);
-        struct dirent *de;
-        DIR *dr = opendir("./frames");
-        if (dr == NULL) {
+    else if (gif_input) {
+        // decode frames straight into the effect, no ffmpeg or ./frames needed
+        GifReader gif;
+        if (!gifOpen(&gif, arguments.input)) {
             fprintf(stderr, "Failed to load frames\n");
             exit(1);
         }
-        char path[50];
-        char processed_path[50];
-        while ((de = readdir(dr)) != NULL) {
-            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
-                continue;
+        int delay;
+        video_input = true;
+        if (isFormat(og_output, "gif") && !from_stdin) {
+            // one palette for the whole gif from every few source frames
+            GifReader sampler;
+            gifOpen(&sampler, arguments.input);
+            while ((og_img = gifNextFrame(&sampler, &delay)) != NULL) {
+                if ((sampler.frame - 1) % PALETTE_FRAME_STRIDE == 0) {
+                    samplePalette(og_img, sampler.g->w, sampler.g->h, 4);
+                }
             }
-            strcpy(path, "./frames/");
-            strcat(path, de->d_name);
-            strcpy(processed_path, "./img/");
-            strcat(processed_path, de->d_name);
-            arguments.input = path;
-            arguments.output = processed_path;
-            modify(args);
+            gifClose(&sampler);
+        }
+        // each frame keeps its own delay instead of the -f rate
+        while ((og_img = gifNextFrame(&gif, &src_delay_ms)) != NULL) {
+            img_w = gif.g->w;
+            img_h = gif.g->h;
+            img_c = 4;
+            processFrame(args);
             printf("\r");
-            printf("Processed frame %s\n", de->d_name);
+            printf("Processed frame %d\n", gif.frame);
             arguments.iterations += arguments.animate_iters;
         }
-        closedir(dr);
+        gifClose(&gif);
+    }
+    else if (yuv_input) {
+        // frames are converted straight from the stream, stdin included
+        YuvReader yuv;
+        if (!yuvOpen(&yuv, arguments.input, arguments.yuv_w, arguments.yuv_h)) {
+            fprintf(stderr, "Failed to load frames\n");
+            exit(1);
+        }
+        video_input = true;
+        // a pipe can't be read twice, there the palette comes from the first frame alone
+        if (isFormat(og_output, "gif") && !from_stdin) {
+            YuvReader sampler;
+            yuvOpen(&sampler, arguments.input, arguments.yuv_w, arguments.yuv_h);
+            while ((og_img = yuvNextFrame(&sampler)) != NULL) {
+                if ((sampler.frame - 1) % PALETTE_FRAME_STRIDE == 0) {
+                    samplePalette(og_img, sampler.w, sampler.h, 3);
+                }
+            }
+            yuvClose(&sampler);
+        }
+        while ((og_img = yuvNextFrame(&yuv)) != NULL) {
+            img_w = yuv.w;
+            img_h = yuv.h;
+            img_c = 3;
+            processFrame(args);
+            printf("\r");
+            printf("Processed frame %d\n", yuv.frame);
+            arguments.iterations += arguments.animate_iters;
+        }
+        yuvClose(&yuv);
+    }
+    else if (endsWith(arguments.input, ".mp4")) {
+        cleanDir("./frames");
+        char cmd[500];
+        sprintf(cmd, "ffmpeg -i %s ./frames/%%04d.%s", arguments.input, isPack(arguments.intermediate) ? "png" : arguments.intermediate);
+        system(cmd);
+        modifySequence(args, "./frames");
+    }
+    else if (isSequence(arguments.input)) {
+        // already extracted frames skip the ffmpeg round trip
+        modifySequence(args, arguments.input);
     }
     else {
         fprintf(stderr, "Invalid input file type\n");
         exit(1);
     }
 
-    clock_t end = clock();
+    // gif frames were already streamed out as they were made
+    if (gif_out.f) {
+        gifEnd(&gif_out);
+    }
+    if (apng_out.f) {
+        apngEnd(&apng_out);
+    }
+    if (avi_out.f) {
+        aviEnd(&avi_out);
+    }
+    if (y4m_out.f) {
+        y4mEnd(&y4m_out);
+    }
+    if (pack_out.f && !packEnd(&pack_out)) {
+        fprintf(stderr, "Failed to write %s\n", PACK_PATH);
+        exit(1);
+    }
 
-    printf("\n\nTime taken: %f seconds\n\n", (double)(end - start) / CLOCKS_PER_SEC);
+    printf("\n\nTime taken: %f seconds\n", now() - start);
+    if (encode_time > 0) {
+        double span = encode_last - encode_first;
+        printf("Encoded %.1f MB of pixels into %.1f MB over %.3f seconds (%.1f MB/s, %.3f seconds of encoder time across threads)\n",
+            encode_in / 1e6, encode_out / 1e6, span, span > 0 ? encode_in / 1e6 / span : 0, encode_time);
+    }
+    printf("\n");
 
-    // if output ends with .gif then convert all images to gif
-    if (endsWith(og_output, ".gif")) {
-        char cmd[500];
-        char img_path[50];
-        strcpy(img_path, "./img/%04d.png");
-        strcpy(cmd, "ffmpeg -y -framerate ");
-        char fr[5];
-        sprintf(fr, "%d", arguments.frame_rate);
-        strcat(cmd, fr);
-        strcat(cmd, " -i ");
-        strcat(cmd, img_path);
-        strcat(cmd, " -filter_complex \"format=rgba,split[x1][x2];[x1]palettegen[p];[x2][p]paletteuse\" -loop 0 ");
-        strcat(cmd, og_output);
-        system(cmd);
+    if (isAnimation(og_output) && frames_written == 0) {
+        fprintf(stderr, "No frames were written to %s\n", og_output);
+        exit(1);
+    }
+    if (isFormat(og_output, "gif") || isFormat(og_output, "apng") || isFormat(og_output, "avi") || isFormat(og_output, "y4m")) {
+        printf("Saved animation to %s (%d frames)\n", og_output, frames_written);
     }
-    else if (endsWith(og_output, ".mp4")) {
+    else if (isFormat(og_output, "mp4") && isPack(arguments.intermediate)) {
+        if (!packToVideo(PACK_PATH, arguments.frame_rate, og_output)) {
+            fprintf(stderr, "Failed to encode %s\n", og_output);
+            exit(1);
+        }
+    }
+    else if (isFormat(og_output, "mp4")) {
         char cmd[500];
         char img_path[50];
-        strcpy(img_path, "./img/%04d.png");
+        sprintf(img_path, "./img/%%04d.%s", arguments.intermediate);
         strcpy(cmd, "ffmpeg -y -framerate ");
         char fr[5];
         sprintf(fr, "%d", arguments.frame_rate);
@@ -474,7 +4266,9 @@ int main(int argc, char** argv) {
         strcat(cmd, og_output);
         system(cmd);
     }
-    else if (endsWith(og_output, ".png") || endsWith(og_output, ".jpg") || endsWith(og_output, ".jpeg")) {
+    else if (isFormat(og_output, "png") || isFormat(og_output, "jpg") || isFormat(og_output, "jpeg") || isFormat(og_output, "qoi") ||
+             isFormat(og_output, "pam") || isFormat(og_output, "ppm") || isFormat(og_output, "pgm") || isFormat(og_output, "pnm") ||
+             isFormat(og_output, "bmp") || isFormat(og_output, "tga")) {
         printf("Saved image to %s\n", og_output);
     }
     else {
@@ -482,5 +4276,7 @@ int main(int argc, char** argv) {
         exit(1);
     }
 
+    poolStop();
+
     return 0;
 }
@@ -515,6 +515,17 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 // flip the image vertically, so the first pixel in the output array is the bottom left
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+// decode jpegs at 1/2, 1/4 or 1/8 size straight from the DCT coefficients,
+// which skips most of the idct and upsampling work. 1 restores full size
+STBIDEF void stbi_set_jpeg_scale_on_load(int denom);
+
+// let the jpeg decoder split work across threads: fn must call work on
+// ranges covering [0, n) and return once they have all finished. baseline
+// jpegs with restart markers decode their segments in parallel, and color
+// conversion runs in bands of rows
+typedef void (*stbi_parallel_for_func)(int n, void (*work)(void *ctx, int start, int end), void *ctx);
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for_func fn);
+
 // as above, but only applies to images loaded on the thread that calls the function
 // this function is only available if your compiler supports thread-local variables;
 // calling it will fail to link if your compiler doesn't
@@ -748,7 +759,7 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
@@ -759,7 +770,7 @@ static int stbi__sse2_available(void)
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -1110,6 +1121,19 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
 #endif
 
 static int stbi__vertically_flip_on_load_global = 0;
+static int stbi__jpeg_scale_on_load = 1;
+
+STBIDEF void stbi_set_jpeg_scale_on_load(int denom)
+{
+   stbi__jpeg_scale_on_load = denom;
+}
+
+static stbi_parallel_for_func stbi__parallel_for = NULL;
+
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for_func fn)
+{
+   stbi__parallel_for = fn;
+}
 
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
 {
@@ -1991,6 +2015,7 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
+   int idct_size; // pixels per side the idct writes for each 8x8 block
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
@@ -2521,6 +2546,59 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
+// reduced-size idcts for scaled decoding: the top-left n x n coefficients go
+// through an n-point idct, so each 8x8 block becomes an n x n block of pixels
+static const int stbi__idct4_table[16] = {
+   stbi__f2f(0.353553391), stbi__f2f( 0.461939766), stbi__f2f( 0.353553391), stbi__f2f( 0.191341716),
+   stbi__f2f(0.353553391), stbi__f2f( 0.191341716), stbi__f2f(-0.353553391), stbi__f2f(-0.461939766),
+   stbi__f2f(0.353553391), stbi__f2f(-0.191341716), stbi__f2f(-0.353553391), stbi__f2f( 0.461939766),
+   stbi__f2f(0.353553391), stbi__f2f(-0.461939766), stbi__f2f( 0.353553391), stbi__f2f(-0.191341716),
+};
+
+static const int stbi__idct2_table[4] = {
+   stbi__f2f(0.353553391), stbi__f2f( 0.353553391),
+   stbi__f2f(0.353553391), stbi__f2f(-0.353553391),
+};
+
+static void stbi__idct_scaled(stbi_uc *out, int out_stride, short data[64], const int *t, int n)
+{
+   int i,j,k, tmp[16];
+   // columns, keeping two extra bits of precision
+   for (i=0; i < n; ++i) {
+      for (j=0; j < n; ++j) {
+         int sum = 0;
+         for (k=0; k < n; ++k)
+            sum += t[j*n+k] * data[k*8+i];
+         tmp[j*n+i] = (sum + 512) >> 10;
+      }
+   }
+   // rows, then descale by 4096*4 and add the 128 level shift
+   for (j=0; j < n; ++j, out += out_stride) {
+      for (i=0; i < n; ++i) {
+         int sum = 0;
+         for (k=0; k < n; ++k)
+            sum += t[i*n+k] * tmp[j*n+k];
+         out[i] = stbi__clamp((sum + (1 << 13) + (128 << 14)) >> 14);
+      }
+   }
+}
+
+static void stbi__idct_half(stbi_uc *out, int out_stride, short data[64])
+{
+   stbi__idct_scaled(out, out_stride, data, stbi__idct4_table, 4);
+}
+
+static void stbi__idct_quarter(stbi_uc *out, int out_stride, short data[64])
+{
+   stbi__idct_scaled(out, out_stride, data, stbi__idct2_table, 2);
+}
+
+static void stbi__idct_eighth(stbi_uc *out, int out_stride, short data[64])
+{
+   STBI_NOTUSED(out_stride);
+   out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+}
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2944,9 +3022,181 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+// decodes MCUs [first, last) of a baseline scan, where a non-interleaved
+// scan counts every 8x8 block as one MCU
+static int stbi__jpeg_decode_mcus(stbi__jpeg *z, int first, int last)
+{
+   STBI_SIMD_ALIGN(short, data[64]);
+   int m,k,x,y;
+   for (m=first; m < last; ++m) {
+      if (z->scan_n == 1) {
+         int n = z->order[0];
+         int w = (z->img_comp[n].x+7) >> 3;
+         int i = m % w, j = m / w;
+         int ha = z->img_comp[n].ha;
+         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+         z->idct_block_kernel(z->img_comp[n].data+(z->img_comp[n].w2*j+i)*z->idct_size, z->img_comp[n].w2, data);
+      } else {
+         int i = m % z->img_mcu_x, j = m / z->img_mcu_x;
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x)*z->idct_size;
+                  int y2 = (j*z->img_comp[n].v + y)*z->idct_size;
+                  int ha = z->img_comp[n].ha;
+                  if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+               }
+            }
+         }
+      }
+   }
+   return 1;
+}
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc *data;
+   int *seg;      // start offset of each restart segment, plus one past the end
+   stbi_uc *ok;   // per segment, set once it decoded cleanly
+   int mcus;      // MCUs in the whole scan
+} stbi__jpeg_segments;
+
+static void stbi__jpeg_decode_segments(void *ctx, int start, int end)
+{
+   stbi__jpeg_segments *job = (stbi__jpeg_segments *) ctx;
+   stbi__jpeg *t = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   stbi__context s;
+   int i;
+   if (!t) return; // segments left without ok fail the whole image
+   // every segment starts from a clean entropy decoder state, so each
+   // worker can run its own copy of the decoder over its own bytes
+   *t = *job->z;
+   t->s = &s;
+   for (i=start; i < end; ++i) {
+      int first = i * job->z->restart_interval;
+      int last = first + job->z->restart_interval;
+      if (last > job->mcus) last = job->mcus;
+      stbi__start_mem(&s, job->data + job->seg[i], job->seg[i+1] - job->seg[i]);
+      stbi__jpeg_reset(t);
+      job->ok[i] = (stbi_uc) stbi__jpeg_decode_mcus(t, first, last);
+   }
+   STBI_FREE(t);
+}
+
+static int stbi__parse_entropy_coded_data_serial(stbi__jpeg *z);
+
+// baseline scans with restart markers: gather the entropy-coded bytes, cut
+// them at the RSTn markers and decode the segments in parallel. Each segment
+// keeps its trailing marker so the bit reader stops there like it would
+// when decoding serially. Stuffed bytes stay in, the bit reader drops them.
+static int stbi__parse_entropy_coded_data_parallel(stbi__jpeg *z)
+{
+   stbi__jpeg_segments job;
+   int len = 0, cap = 1 << 16, nseg = 0, segcap = 64, i, ok = 1;
+   job.z = z;
+   job.data = (stbi_uc *) stbi__malloc(cap);
+   job.seg = (int *) stbi__malloc(segcap * sizeof(int));
+   if (!job.data || !job.seg) {
+      STBI_FREE(job.data); STBI_FREE(job.seg);
+      return stbi__err("outofmem", "Out of memory");
+   }
+   job.seg[nseg++] = 0;
+   while (!stbi__at_eof(z->s)) {
+      // copy whatever is buffered up to the next 0xff in one go
+      int avail = (int) (z->s->img_buffer_end - z->s->img_buffer);
+      stbi_uc *ff = avail ? (stbi_uc *) memchr(z->s->img_buffer, 0xff, avail) : NULL;
+      int run = ff ? (int) (ff - z->s->img_buffer) : avail;
+      stbi_uc b, c = 0;
+      while (len + run + 2 > cap) {
+         stbi_uc *p = (stbi_uc *) STBI_REALLOC_SIZED(job.data, cap, cap*2);
+         if (!p) { STBI_FREE(job.data); STBI_FREE(job.seg); return stbi__err("outofmem", "Out of memory"); }
+         job.data = p;
+         cap *= 2;
+      }
+      if (run) {
+         memcpy(job.data + len, z->s->img_buffer, run);
+         z->s->img_buffer += run;
+         len += run;
+         continue;
+      }
+      b = stbi__get8(z->s);
+      if (b == 0xff) {
+         c = stbi__get8(z->s);
+         while (c == 0xff) c = stbi__get8(z->s); // consume fill bytes
+      }
+      job.data[len++] = b;
+      if (b == 0xff) {
+         job.data[len++] = c;
+         if (STBI__RESTART(c)) {
+            if (nseg + 2 > segcap) {
+               int *p = (int *) STBI_REALLOC_SIZED(job.seg, segcap*sizeof(int), segcap*2*sizeof(int));
+               if (!p) { STBI_FREE(job.data); STBI_FREE(job.seg); return stbi__err("outofmem", "Out of memory"); }
+               job.seg = p;
+               segcap *= 2;
+            }
+            job.seg[nseg++] = len;
+         } else if (c != 0) {
+            z->marker = c;
+            break;
+         }
+      }
+   }
+   job.seg[nseg] = len;
+
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      job.mcus = ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   } else {
+      job.mcus = z->img_mcu_x * z->img_mcu_y;
+   }
+
+   if (nseg != (job.mcus + z->restart_interval - 1) / z->restart_interval) {
+      // missing or extra RSTn markers: segments no longer line up with MCUs,
+      // so run the serial decoder over the gathered bytes instead
+      stbi__context *s = z->s;
+      stbi__context mem;
+      int marker = z->marker;
+      stbi__start_mem(&mem, job.data, len);
+      z->s = &mem;
+      stbi__jpeg_reset(z);
+      ok = stbi__parse_entropy_coded_data_serial(z);
+      z->s = s;
+      z->marker = marker;
+      STBI_FREE(job.data);
+      STBI_FREE(job.seg);
+      return ok;
+   }
+
+   job.ok = (stbi_uc *) stbi__malloc(nseg);
+   if (!job.ok) {
+      STBI_FREE(job.data); STBI_FREE(job.seg);
+      return stbi__err("outofmem", "Out of memory");
+   }
+   memset(job.ok, 0, nseg);
+   stbi__parallel_for(nseg, stbi__jpeg_decode_segments, &job);
+   for (i=0; i < nseg; ++i)
+      if (!job.ok[i]) ok = 0;
+   STBI_FREE(job.ok);
+   STBI_FREE(job.data);
+   STBI_FREE(job.seg);
+   // the worker's own error string is lost with its thread, report it here
+   if (!ok) return stbi__err("bad segment", "Corrupt JPEG");
+   return 1;
+}
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
    stbi__jpeg_reset(z);
+   if (!z->progressive && z->restart_interval && stbi__parallel_for)
+      return stbi__parse_entropy_coded_data_parallel(z);
+   return stbi__parse_entropy_coded_data_serial(z);
+}
+
+static int stbi__parse_entropy_coded_data_serial(stbi__jpeg *z)
+{
    if (!z->progressive) {
       if (z->scan_n == 1) {
          int i,j;
@@ -2962,7 +3212,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
                if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               z->idct_block_kernel(z->img_comp[n].data+(z->img_comp[n].w2*j+i)*z->idct_size, z->img_comp[n].w2, data);
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
@@ -2986,8 +3236,8 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   // by the basic H and V specified for the component
                   for (y=0; y < z->img_comp[n].v; ++y) {
                      for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
+                        int x2 = (i*z->img_comp[n].h + x)*z->idct_size;
+                        int y2 = (j*z->img_comp[n].v + y)*z->idct_size;
                         int ha = z->img_comp[n].ha;
                         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
                         z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
@@ -3087,7 +3337,7 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               z->idct_block_kernel(z->img_comp[n].data+(z->img_comp[n].w2*j+i)*z->idct_size, z->img_comp[n].w2, data);
             }
          }
       }
@@ -3327,8 +3577,9 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      // scaled decoding shrinks the planes along with the blocks
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * z->idct_size;
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * z->idct_size;
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
@@ -3338,10 +3589,10 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       // align blocks for idct using mmx/sse
       z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+         // coefficients are always kept for every 8x8 block
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].coeff_w * 8, z->img_comp[i].coeff_h * 8, sizeof(short), 15);
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
@@ -3818,6 +4069,7 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
+   j->idct_size = 8;
    j->idct_block_kernel = stbi__idct_block;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
@@ -3860,6 +4112,150 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi__resample res_comp[4];
+   stbi_uc *output;
+   int n, decode_n, is_rgb;
+   int failed;
+} stbi__jpeg_convert;
+
+// resamples and color converts output rows [start, end). the resampler
+// state is derived from the first row, so bands of rows are independent
+static void stbi__jpeg_convert_rows(void *ctx, int start, int end)
+{
+   stbi__jpeg_convert *c = (stbi__jpeg_convert *) ctx;
+   stbi__jpeg *z = c->z;
+   stbi__resample res_comp[4];
+   stbi_uc *linebuf[4] = { NULL, NULL, NULL, NULL };
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+   stbi_uc *lastrow;
+   int n = c->n, decode_n = c->decode_n, is_rgb = c->is_rgb;
+   unsigned int i;
+   int j,k, ok = 1;
+
+   for (k=0; k < decode_n; ++k) {
+      stbi__resample *r = &res_comp[k];
+      int steps = (c->res_comp[k].vs >> 1) + start;
+      int last = z->img_comp[k].y - 1;
+      *r = c->res_comp[k];
+      r->ystep = steps % r->vs;
+      r->ypos  = steps / r->vs;
+      r->line1 = z->img_comp[k].data + (r->ypos < last ? r->ypos : last) * z->img_comp[k].w2;
+      r->line0 = r->ypos == 0 ? r->line1 : z->img_comp[k].data + (r->ypos-1 < last ? r->ypos-1 : last) * z->img_comp[k].w2;
+      // allocate line buffer big enough for upsampling off the edges
+      // with upsample factor of 4
+      linebuf[k] = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
+      if (!linebuf[k]) ok = 0;
+   }
+   // the 3 channel writers store a 4th byte past each pixel, which on the
+   // band's last row would land in the first pixel of the next band
+   lastrow = (stbi_uc *) stbi__malloc(n * z->s->img_x + 1);
+   if (!lastrow) ok = 0;
+   if (!ok) c->failed = 1;
+
+   for (j=start; ok && j < end; ++j) {
+      stbi_uc *out = j == end-1 ? lastrow : c->output + n * z->s->img_x * j;
+      for (k=0; k < decode_n; ++k) {
+         stbi__resample *r = &res_comp[k];
+         int y_bot = r->ystep >= (r->vs >> 1);
+         coutput[k] = r->resample(linebuf[k],
+                                  y_bot ? r->line1 : r->line0,
+                                  y_bot ? r->line0 : r->line1,
+                                  r->w_lores, r->hs);
+         if (++r->ystep >= r->vs) {
+            r->ystep = 0;
+            r->line0 = r->line1;
+            if (++r->ypos < z->img_comp[k].y)
+               r->line1 += z->img_comp[k].w2;
+         }
+      }
+      if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (is_rgb) {
+               for (i=0; i < z->s->img_x; ++i) {
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  out[3] = 255;
+                  out += n;
+               }
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
+               for (i=0; i < z->s->img_x; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                  out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                  out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                  out[3] = 255;
+                  out += n;
+               }
+            } else if (z->app14_color_transform == 2) { // YCCK
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+               for (i=0; i < z->s->img_x; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(255 - out[0], m);
+                  out[1] = stbi__blinn_8x8(255 - out[1], m);
+                  out[2] = stbi__blinn_8x8(255 - out[2], m);
+                  out += n;
+               }
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               out[3] = 255; // not used if n==3
+               out += n;
+            }
+      } else {
+         if (is_rgb) {
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i)
+                  *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+               for (i=0; i < z->s->img_x; ++i, out += 2) {
+                  out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+                  out[1] = 255;
+               }
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < z->s->img_x; ++i) {
+               stbi_uc m = coutput[3][i];
+               stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+               stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+               stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+               out[0] = stbi__compute_y(r, g, b);
+               out[1] = 255;
+               out += n;
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+               out[1] = 255;
+               out += n;
+            }
+         } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
+            else
+               for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
+         }
+      }
+   }
+   if (ok && end > start)
+      memcpy(c->output + n * z->s->img_x * (end-1), lastrow, n * z->s->img_x);
+   STBI_FREE(lastrow);
+   for (k=0; k < decode_n; ++k)
+      STBI_FREE(linebuf[k]);
+}
+
 static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
    int n, decode_n, is_rgb;
@@ -3871,6 +4267,16 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // load a jpeg image from whichever source, but leave in YCbCr format
    if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
 
+   // scaled decoding: everything from here on works on the reduced planes
+   if (z->idct_size != 8) {
+      z->s->img_x = (z->s->img_x * z->idct_size + 7) / 8;
+      z->s->img_y = (z->s->img_y * z->idct_size + 7) / 8;
+      for (n=0; n < z->s->img_n; ++n) {
+         z->img_comp[n].x = (z->img_comp[n].x * z->idct_size + 7) / 8;
+         z->img_comp[n].y = (z->img_comp[n].y * z->idct_size + 7) / 8;
+      }
+   }
+
    // determine actual number of components to generate
    n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
 
@@ -3888,26 +4294,18 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // resample and color-convert
    {
       int k;
-      unsigned int i,j;
-      stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
-
-      stbi__resample res_comp[4];
+      stbi__jpeg_convert c;
+      c.z = z;
+      c.n = n;
+      c.decode_n = decode_n;
+      c.is_rgb = is_rgb;
+      c.failed = 0;
 
       for (k=0; k < decode_n; ++k) {
-         stbi__resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
+         stbi__resample *r = &c.res_comp[k];
          r->hs      = z->img_h_max / z->img_comp[k].h;
          r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
          r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
 
          if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
          else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
@@ -3916,110 +4314,20 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
          else                               r->resample = stbi__resample_row_generic;
       }
 
-      // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+      c.output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
+      if (!c.output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
 
       // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
-            }
-         }
-      }
+      if (stbi__parallel_for)
+         stbi__parallel_for(z->s->img_y, stbi__jpeg_convert_rows, &c);
+      else
+         stbi__jpeg_convert_rows(&c, 0, z->s->img_y);
       stbi__cleanup_jpeg(z);
+      if (c.failed) { STBI_FREE(c.output); return stbi__errpuc("outofmem", "Out of memory"); }
       *out_x = z->s->img_x;
       *out_y = z->s->img_y;
       if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
-      return output;
+      return c.output;
    }
 }
 
@@ -4032,6 +4340,11 @@ static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int re
    STBI_NOTUSED(ri);
    j->s = s;
    stbi__setup_jpeg(j);
+   switch (stbi__jpeg_scale_on_load) {
+      case 2: j->idct_size = 4; j->idct_block_kernel = stbi__idct_half;    break;
+      case 4: j->idct_size = 2; j->idct_block_kernel = stbi__idct_quarter; break;
+      case 8: j->idct_size = 1; j->idct_block_kernel = stbi__idct_eighth;  break;
+   }
    result = load_jpeg_image(j, x,y,comp,req_comp);
    STBI_FREE(j);
    return result;
@@ -4646,6 +4959,100 @@ static int stbi__paeth(int a, int b, int c)
 
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
+#if defined(STBI_SSE2) && !defined(STBI_NO_PNG)
+// SSE2 unfiltering for 8-bit rows with 3 or 4 bytes per pixel. Sub, Avg and
+// Paeth depend on the pixel to the left, so those work one pixel per step
+// with each channel in a 16-bit lane; Up has no such dependency and runs 16
+// bytes at a time. Results match the scalar loops exactly.
+//
+// Pixels move as whole 4-byte words; with 3-byte pixels the spare byte
+// belongs to the next pixel and is rewritten by it, so only the final
+// pixel of a row needs an exact 3-byte move.
+static __m128i stbi__load_px(const stbi_uc *p, int whole)
+{
+   int v = 0;
+   if (whole) memcpy(&v, p, 4);
+   else memcpy(&v, p, 3);
+   return _mm_unpacklo_epi8(_mm_cvtsi32_si128(v), _mm_setzero_si128());
+}
+
+static void stbi__store_px(stbi_uc *p, __m128i v, int whole)
+{
+   int t = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+   if (whole) memcpy(p, &t, 4);
+   else memcpy(p, &t, 3);
+}
+
+static __m128i stbi__abs_epi16(__m128i x)
+{
+   __m128i neg = _mm_cmplt_epi16(x, _mm_setzero_si128());
+   return _mm_sub_epi16(_mm_xor_si128(x, neg), neg);
+}
+
+static __m128i stbi__select(__m128i mask, __m128i a, __m128i b)
+{
+   return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// unfilters nk bytes past the first pixel; returns 0 if the filter isn't handled here
+static int stbi__unfilter_sse2(int filter, stbi_uc *cur, const stbi_uc *prior, const stbi_uc *raw, int nk, int n)
+{
+   const __m128i lo_byte = _mm_set1_epi16(0xff);
+   __m128i a, b, c, d;
+   int k, w;
+   switch (filter) {
+      case STBI__F_up:
+         for (k=0; k+16 <= nk; k += 16) {
+            __m128i r = _mm_loadu_si128((const __m128i *) (raw+k));
+            __m128i p = _mm_loadu_si128((const __m128i *) (prior+k));
+            _mm_storeu_si128((__m128i *) (cur+k), _mm_add_epi8(r, p));
+         }
+         for (; k < nk; ++k)
+            cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+         return 1;
+      case STBI__F_sub:
+         a = stbi__load_px(cur-n, 1);
+         for (k=0; k < nk; k += n) {
+            w = k+4 <= nk;
+            a = _mm_and_si128(_mm_add_epi16(a, stbi__load_px(raw+k, w)), lo_byte);
+            stbi__store_px(cur+k, a, w);
+         }
+         return 1;
+      case STBI__F_avg:
+         a = stbi__load_px(cur-n, 1);
+         for (k=0; k < nk; k += n) {
+            w = k+4 <= nk;
+            b = stbi__load_px(prior+k, w);
+            d = _mm_srli_epi16(_mm_add_epi16(a, b), 1);
+            a = _mm_and_si128(_mm_add_epi16(d, stbi__load_px(raw+k, w)), lo_byte);
+            stbi__store_px(cur+k, a, w);
+         }
+         return 1;
+      case STBI__F_paeth:
+         a = stbi__load_px(cur-n, 1);
+         c = stbi__load_px(prior-n, 1);
+         for (k=0; k < nk; k += n) {
+            __m128i pa, pb, pc, m;
+            w = k+4 <= nk;
+            b = stbi__load_px(prior+k, w);
+            // p = a+b-c, so |p-a| = |b-c|, |p-b| = |a-c| and |p-c| = |a+b-2c|
+            pa = _mm_sub_epi16(b, c);
+            pb = _mm_sub_epi16(a, c);
+            pc = stbi__abs_epi16(_mm_add_epi16(pa, pb));
+            pa = stbi__abs_epi16(pa);
+            pb = stbi__abs_epi16(pb);
+            m = _mm_min_epi16(pa, _mm_min_epi16(pb, pc));
+            d = stbi__select(_mm_cmpeq_epi16(m, pa), a, stbi__select(_mm_cmpeq_epi16(m, pb), b, c));
+            a = _mm_and_si128(_mm_add_epi16(d, stbi__load_px(raw+k, w)), lo_byte);
+            stbi__store_px(cur+k, a, w);
+            c = b;
+         }
+         return 1;
+   }
+   return 0;
+}
+#endif
+
 // create the png data from post-deflated data
 static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
 {
@@ -4731,7 +5138,12 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
          #define STBI__CASE(f) \
              case f:     \
                 for (k=0; k < nk; ++k)
-         switch (filter) {
+         int done = 0;
+         #ifdef STBI_SSE2
+         if (depth == 8 && (filter_bytes == 3 || filter_bytes == 4) && stbi__sse2_available())
+            done = stbi__unfilter_sse2(filter, cur, prior, raw, nk, filter_bytes);
+         #endif
+         if (!done) switch (filter) {
             // "none" filter turns into a memcpy here; make that explicit.
             case STBI__F_none:         memcpy(cur, raw, nk); break;
             STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]); } break;
@@ -6818,10 +7230,11 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
             }
          }
       } else if (dispose == 2) {
-         // restore what was changed last frame to background before that frame;
+         // clear what was changed last frame to transparent, like browsers do,
+         // rather than back to whatever was there before that frame
          for (pi = 0; pi < pcount; ++pi) {
             if (g->history[pi]) {
-               memcpy( &g->out[pi * 4], &g->background[pi * 4], 4 );
+               memset( &g->out[pi * 4], 0, 4 );
             }
          }
       } else {
@@ -247,6 +247,11 @@ STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 
 #define STBIW_UCHAR(x) (unsigned char) ((x) & 0xff)
 
+#if !defined(STBIW_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define STBIW_SSE2
+#include <emmintrin.h>
+#endif
+
 #ifdef STB_IMAGE_WRITE_STATIC
 static int stbi_write_png_compression_level = 8;
 static int stbi_write_tga_with_rle = 1;
@@ -1256,9 +1261,9 @@ static void stbiw__jpg_writeBits(stbi__write_context *s, int *bitBufP, int *bitC
    bitBuf |= bs[0] << (24 - bitCnt);
    while(bitCnt >= 8) {
       unsigned char c = (bitBuf >> 16) & 255;
-      stbiw__putc(s, c);
+      stbiw__write1(s, c);
       if(c == 255) {
-         stbiw__putc(s, 0);
+         stbiw__write1(s, 0);
       }
       bitBuf <<= 8;
       bitCnt -= 8;
@@ -1267,6 +1272,7 @@ static void stbiw__jpg_writeBits(stbi__write_context *s, int *bitBufP, int *bitC
    *bitCntP = bitCnt;
 }
 
+#ifndef STBIW_SSE2
 static void stbiw__jpg_DCT(float *d0p, float *d1p, float *d2p, float *d3p, float *d4p, float *d5p, float *d6p, float *d7p) {
    float d0 = *d0p, d1 = *d1p, d2 = *d2p, d3 = *d3p, d4 = *d4p, d5 = *d5p, d6 = *d6p, d7 = *d7p;
    float z1, z2, z3, z4, z5, z11, z13;
@@ -1314,22 +1320,100 @@ static void stbiw__jpg_DCT(float *d0p, float *d1p, float *d2p, float *d3p, float
 
    *d0p = d0;  *d2p = d2;  *d4p = d4;  *d6p = d6;
 }
+#endif
 
-static void stbiw__jpg_calcBits(int val, unsigned short bits[2]) {
-   int tmp1 = val < 0 ? -val : val;
-   val = val < 0 ? val-1 : val;
-   bits[1] = 1;
-   while(tmp1 >>= 1) {
-      ++bits[1];
-   }
-   bits[0] = val & ((1<<bits[1])-1);
+#ifdef STBIW_SSE2
+// same butterflies as stbiw__jpg_DCT, run across four columns at once
+static void stbiw__jpg_DCT_sse2(__m128 *d) {
+   __m128 z1, z2, z3, z4, z5, z11, z13;
+
+   __m128 tmp0 = _mm_add_ps(d[0], d[7]);
+   __m128 tmp7 = _mm_sub_ps(d[0], d[7]);
+   __m128 tmp1 = _mm_add_ps(d[1], d[6]);
+   __m128 tmp6 = _mm_sub_ps(d[1], d[6]);
+   __m128 tmp2 = _mm_add_ps(d[2], d[5]);
+   __m128 tmp5 = _mm_sub_ps(d[2], d[5]);
+   __m128 tmp3 = _mm_add_ps(d[3], d[4]);
+   __m128 tmp4 = _mm_sub_ps(d[3], d[4]);
+
+   // Even part
+   __m128 tmp10 = _mm_add_ps(tmp0, tmp3);
+   __m128 tmp13 = _mm_sub_ps(tmp0, tmp3);
+   __m128 tmp11 = _mm_add_ps(tmp1, tmp2);
+   __m128 tmp12 = _mm_sub_ps(tmp1, tmp2);
+
+   d[0] = _mm_add_ps(tmp10, tmp11);
+   d[4] = _mm_sub_ps(tmp10, tmp11);
+
+   z1 = _mm_mul_ps(_mm_add_ps(tmp12, tmp13), _mm_set1_ps(0.707106781f));
+   d[2] = _mm_add_ps(tmp13, z1);
+   d[6] = _mm_sub_ps(tmp13, z1);
+
+   // Odd part
+   tmp10 = _mm_add_ps(tmp4, tmp5);
+   tmp11 = _mm_add_ps(tmp5, tmp6);
+   tmp12 = _mm_add_ps(tmp6, tmp7);
+
+   z5 = _mm_mul_ps(_mm_sub_ps(tmp10, tmp12), _mm_set1_ps(0.382683433f));
+   z2 = _mm_add_ps(_mm_mul_ps(tmp10, _mm_set1_ps(0.541196100f)), z5);
+   z4 = _mm_add_ps(_mm_mul_ps(tmp12, _mm_set1_ps(1.306562965f)), z5);
+   z3 = _mm_mul_ps(tmp11, _mm_set1_ps(0.707106781f));
+
+   z11 = _mm_add_ps(tmp7, z3);
+   z13 = _mm_sub_ps(tmp7, z3);
+
+   d[5] = _mm_add_ps(z13, z2);
+   d[3] = _mm_sub_ps(z13, z2);
+   d[1] = _mm_add_ps(z11, z4);
+   d[7] = _mm_sub_ps(z11, z4);
 }
 
-static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt, float *CDU, int du_stride, float *fdtbl, int DC, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2]) {
-   const unsigned short EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
-   const unsigned short M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
-   int dataOff, i, j, n, diff, end0pos, x, y;
-   int DU[64];
+// lo holds columns 0-3 of each row, hi columns 4-7
+static void stbiw__jpg_transpose_sse2(__m128 *lo, __m128 *hi) {
+   __m128 t;
+   _MM_TRANSPOSE4_PS(lo[0], lo[1], lo[2], lo[3]);
+   _MM_TRANSPOSE4_PS(hi[0], hi[1], hi[2], hi[3]);
+   _MM_TRANSPOSE4_PS(lo[4], lo[5], lo[6], lo[7]);
+   _MM_TRANSPOSE4_PS(hi[4], hi[5], hi[6], hi[7]);
+   t = hi[0]; hi[0] = lo[4]; lo[4] = t;
+   t = hi[1]; hi[1] = lo[5]; lo[5] = t;
+   t = hi[2]; hi[2] = lo[6]; lo[6] = t;
+   t = hi[3]; hi[3] = lo[7]; lo[7] = t;
+}
+#endif
+
+// Forward DCT of one 8x8 block, then quantize/descale/zigzag the coefficients into DU
+static void stbiw__jpg_DCT_quantize(float *CDU, int du_stride, const float *fdtbl, int *DU) {
+#ifdef STBIW_SSE2
+   __m128 lo[8], hi[8];
+   __m128 sign = _mm_set1_ps(-0.0f), half = _mm_set1_ps(0.5f);
+   int q[64], j;
+
+   for(j = 0; j < 8; ++j) {
+      lo[j] = _mm_loadu_ps(CDU + j*du_stride);
+      hi[j] = _mm_loadu_ps(CDU + j*du_stride + 4);
+   }
+   // rows are done as columns of the transposed block, keeping the scalar order of operations
+   stbiw__jpg_transpose_sse2(lo, hi);
+   stbiw__jpg_DCT_sse2(lo);
+   stbiw__jpg_DCT_sse2(hi);
+   stbiw__jpg_transpose_sse2(lo, hi);
+   stbiw__jpg_DCT_sse2(lo);
+   stbiw__jpg_DCT_sse2(hi);
+   for(j = 0; j < 8; ++j) {
+      // round half away from zero, as the scalar path does
+      __m128 a = _mm_mul_ps(lo[j], _mm_loadu_ps(fdtbl + j*8));
+      __m128 b = _mm_mul_ps(hi[j], _mm_loadu_ps(fdtbl + j*8 + 4));
+      a = _mm_add_ps(a, _mm_or_ps(_mm_and_ps(a, sign), half));
+      b = _mm_add_ps(b, _mm_or_ps(_mm_and_ps(b, sign), half));
+      _mm_storeu_si128((__m128i *)(q + j*8), _mm_cvttps_epi32(a));
+      _mm_storeu_si128((__m128i *)(q + j*8 + 4), _mm_cvttps_epi32(b));
+   }
+   for(j = 0; j < 64; ++j) {
+      DU[stbiw__jpg_ZigZag[j]] = q[j];
+   }
+#else
+   int dataOff, i, j, n, x, y;
 
    // DCT rows
    for(dataOff=0, n=du_stride*8; dataOff<n; dataOff+=du_stride) {
@@ -1351,6 +1435,85 @@ static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt
          DU[stbiw__jpg_ZigZag[j]] = (int)(v < 0 ? v - 0.5f : v + 0.5f);
       }
    }
+#endif
+}
+
+// Converts n (a multiple of 4) pixels of one row starting at column x, repeating the last column past the edge
+static void stbiw__jpg_convertRow(const unsigned char *dataR, const unsigned char *dataG, const unsigned char *dataB, int base_p, int x, int n, int width, int comp, float *Y, float *U, float *V) {
+   int i;
+#ifdef STBIW_SSE2
+   int r[16], g[16], b[16];
+   for(i = 0; i < n; ++i) {
+      int col = x + i;
+      int p = base_p + ((col < width) ? col : (width-1))*comp;
+      r[i] = dataR[p]; g[i] = dataG[p]; b[i] = dataB[p];
+   }
+   for(i = 0; i < n; i += 4) {
+      __m128 fr = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(r + i)));
+      __m128 fg = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(g + i)));
+      __m128 fb = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(b + i)));
+      __m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(fr, _mm_set1_ps(0.29900f)), _mm_mul_ps(fg, _mm_set1_ps(0.58700f))), _mm_mul_ps(fb, _mm_set1_ps(0.11400f)));
+      __m128 u = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(fr, _mm_set1_ps(-0.16874f)), _mm_mul_ps(fg, _mm_set1_ps(0.33126f))), _mm_mul_ps(fb, _mm_set1_ps(0.50000f)));
+      __m128 v = _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(fr, _mm_set1_ps(0.50000f)), _mm_mul_ps(fg, _mm_set1_ps(0.41869f))), _mm_mul_ps(fb, _mm_set1_ps(0.08131f)));
+      _mm_storeu_ps(Y + i, _mm_sub_ps(y, _mm_set1_ps(128.0f)));
+      _mm_storeu_ps(U + i, u);
+      _mm_storeu_ps(V + i, v);
+   }
+#else
+   for(i = 0; i < n; ++i) {
+      int col = x + i;
+      // if col >= width => use pixel from last input column
+      int p = base_p + ((col < width) ? col : (width-1))*comp;
+      float r = dataR[p], g = dataG[p], b = dataB[p];
+      Y[i]= +0.29900f*r + 0.58700f*g + 0.11400f*b - 128;
+      U[i]= -0.16874f*r - 0.33126f*g + 0.50000f*b;
+      V[i]= +0.50000f*r - 0.41869f*g - 0.08131f*b;
+   }
+#endif
+}
+
+// Averages each 2x2 block of a 16x16 chroma plane down to 8x8
+static void stbiw__jpg_subsample(const float *C, float *sub) {
+   int yy, xx, pos;
+#ifdef STBIW_SSE2
+   for(yy = 0, pos = 0; yy < 8; ++yy) {
+      for(xx = 0; xx < 8; xx += 4, pos += 4) {
+         const float *c = C + yy*32 + xx*2;
+         __m128 a0 = _mm_loadu_ps(c), a1 = _mm_loadu_ps(c + 4);
+         __m128 b0 = _mm_loadu_ps(c + 16), b1 = _mm_loadu_ps(c + 20);
+         __m128 sum = _mm_add_ps(_mm_shuffle_ps(a0, a1, _MM_SHUFFLE(2,0,2,0)), _mm_shuffle_ps(a0, a1, _MM_SHUFFLE(3,1,3,1)));
+         sum = _mm_add_ps(sum, _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(2,0,2,0)));
+         sum = _mm_add_ps(sum, _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(3,1,3,1)));
+         _mm_storeu_ps(sub + pos, _mm_mul_ps(sum, _mm_set1_ps(0.25f)));
+      }
+   }
+#else
+   for(yy = 0, pos = 0; yy < 8; ++yy) {
+      for(xx = 0; xx < 8; ++xx, ++pos) {
+         int j = yy*32+xx*2;
+         sub[pos] = (C[j+0] + C[j+1] + C[j+16] + C[j+17]) * 0.25f;
+      }
+   }
+#endif
+}
+
+static void stbiw__jpg_calcBits(int val, unsigned short bits[2]) {
+   int tmp1 = val < 0 ? -val : val;
+   val = val < 0 ? val-1 : val;
+   bits[1] = 1;
+   while(tmp1 >>= 1) {
+      ++bits[1];
+   }
+   bits[0] = val & ((1<<bits[1])-1);
+}
+
+static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt, float *CDU, int du_stride, float *fdtbl, int DC, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2]) {
+   const unsigned short EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
+   const unsigned short M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
+   int i, diff, end0pos;
+   int DU[64];
+
+   stbiw__jpg_DCT_quantize(CDU, du_stride, fdtbl, DU);
 
    // Encode DC
    diff = DU[0] - DC;
@@ -1534,18 +1697,11 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
          for(y = 0; y < height; y += 16) {
             for(x = 0; x < width; x += 16) {
                float Y[256], U[256], V[256];
-               for(row = y, pos = 0; row < y+16; ++row) {
+               for(row = y, pos = 0; row < y+16; ++row, pos += 16) {
                   // row >= height => use last input row
                   int clamped_row = (row < height) ? row : height - 1;
                   int base_p = (stbi__flip_vertically_on_write ? (height-1-clamped_row) : clamped_row)*width*comp;
-                  for(col = x; col < x+16; ++col, ++pos) {
-                     // if col >= width => use pixel from last input column
-                     int p = base_p + ((col < width) ? col : (width-1))*comp;
-                     float r = dataR[p], g = dataG[p], b = dataB[p];
-                     Y[pos]= +0.29900f*r + 0.58700f*g + 0.11400f*b - 128;
-                     U[pos]= -0.16874f*r - 0.33126f*g + 0.50000f*b;
-                     V[pos]= +0.50000f*r - 0.41869f*g - 0.08131f*b;
-                  }
+                  stbiw__jpg_convertRow(dataR, dataG, dataB, base_p, x, 16, width, comp, Y+pos, U+pos, V+pos);
                }
                DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+0,   16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
                DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+8,   16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
@@ -1555,14 +1711,8 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
                // subsample U,V
                {
                   float subU[64], subV[64];
-                  int yy, xx;
-                  for(yy = 0, pos = 0; yy < 8; ++yy) {
-                     for(xx = 0; xx < 8; ++xx, ++pos) {
-                        int j = yy*32+xx*2;
-                        subU[pos] = (U[j+0] + U[j+1] + U[j+16] + U[j+17]) * 0.25f;
-                        subV[pos] = (V[j+0] + V[j+1] + V[j+16] + V[j+17]) * 0.25f;
-                     }
-                  }
+                  stbiw__jpg_subsample(U, subU);
+                  stbiw__jpg_subsample(V, subV);
                   DCU = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, subU, 8, fdtbl_UV, DCU, UVDC_HT, UVAC_HT);
                   DCV = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, subV, 8, fdtbl_UV, DCV, UVDC_HT, UVAC_HT);
                }
@@ -1572,18 +1722,11 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
          for(y = 0; y < height; y += 8) {
             for(x = 0; x < width; x += 8) {
                float Y[64], U[64], V[64];
-               for(row = y, pos = 0; row < y+8; ++row) {
+               for(row = y, pos = 0; row < y+8; ++row, pos += 8) {
                   // row >= height => use last input row
                   int clamped_row = (row < height) ? row : height - 1;
                   int base_p = (stbi__flip_vertically_on_write ? (height-1-clamped_row) : clamped_row)*width*comp;
-                  for(col = x; col < x+8; ++col, ++pos) {
-                     // if col >= width => use pixel from last input column
-                     int p = base_p + ((col < width) ? col : (width-1))*comp;
-                     float r = dataR[p], g = dataG[p], b = dataB[p];
-                     Y[pos]= +0.29900f*r + 0.58700f*g + 0.11400f*b - 128;
-                     U[pos]= -0.16874f*r - 0.33126f*g + 0.50000f*b;
-                     V[pos]= +0.50000f*r - 0.41869f*g - 0.08131f*b;
-                  }
+                  stbiw__jpg_convertRow(dataR, dataG, dataB, base_p, x, 8, width, comp, Y+pos, U+pos, V+pos);
                }
 
                DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y, 8, fdtbl_Y,  DCY, YDC_HT, YAC_HT);
@@ -1595,6 +1738,7 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
 
       // Do the bit alignment of the EOI marker
       stbiw__jpg_writeBits(s, &bitBuf, &bitCnt, fillBits);
+      stbiw__write_flush(s);
    }
 
    // EOI